@@ -10,90 +10,105 @@
 
 extern volatile ngx_cycle_t  *ngx_cycle;
 
-typedef struct {
-    ngx_str_t  name;
-    ngx_uint_t hash;
-    ngx_uint_t code;
-} request_known_headers_t;
-
 typedef struct {
     ngx_str_t  name;
     ngx_str_t  lowcase_name;
     ngx_uint_t hash;
+    /* the entry of the upstream's "headers_in_hash", NULL if none */
+    ngx_http_upstream_header_t *hh;
 } response_known_headers_t;
 
 
-static void request_known_headers_calc_hash(void);
-static void response_known_headers_calc_hash(void);
-
-
-static request_known_headers_t request_known_headers[] = {
-    {ngx_string("accept"),          0, SC_REQ_ACCEPT},
-    {ngx_string("accept-charset"),  0, SC_REQ_ACCEPT_CHARSET},
-    {ngx_string("accept-encoding"), 0, SC_REQ_ACCEPT_ENCODING},
-    {ngx_string("accept-language"), 0, SC_REQ_ACCEPT_LANGUAGE},
-    {ngx_string("authorization"),   0, SC_REQ_AUTHORIZATION},
-    {ngx_string("connection"),      0, SC_REQ_CONNECTION},
-    {ngx_string("content-type"),    0, SC_REQ_CONTENT_TYPE},
-    {ngx_string("content-length"),  0, SC_REQ_CONTENT_LENGTH},
-    {ngx_string("cookie"),          0, SC_REQ_COOKIE},
-    {ngx_string("cookie2"),         0, SC_REQ_COOKIE2},
-    {ngx_string("host"),            0, SC_REQ_HOST},
-    {ngx_string("pragma"),          0, SC_REQ_PRAGMA},
-    {ngx_string("referer"),         0, SC_REQ_REFERER},
-    {ngx_string("user-agent"),      0, SC_REQ_USER_AGENT},
-    {ngx_null_string, 0, 0}
-};
+static void response_known_headers_calc_hash(
+    ngx_http_upstream_main_conf_t *umcf);
+
 
 static response_known_headers_t response_known_headers[] = {
-    {ngx_string("Content-Type"),     ngx_string("content-type"), 0},
-    {ngx_string("Content-Language"), ngx_string("content-language"), 0},
-    {ngx_string("Content-Length"),   ngx_string("content-length"), 0},
-    {ngx_string("Date"),             ngx_string("date"), 0},
-    {ngx_string("Last-Modified"),    ngx_string("last-modified"), 0},
-    {ngx_string("Location"),         ngx_string("location"), 0},
-    {ngx_string("Set-Cookie"),       ngx_string("set-cookie"), 0},
-    {ngx_string("Set-Cookie2"),      ngx_string("set-cookie2"), 0},
-    {ngx_string("Servlet-Engine"),   ngx_string("servlet-engine"), 0},
-    {ngx_string("Status"),           ngx_string("status"), 0},
-    {ngx_string("WWW-Authenticate"), ngx_string("www-authenticate"), 0},
-    {ngx_null_string, ngx_null_string, 0}
+    {ngx_string("Content-Type"),     ngx_string("content-type"), 0, NULL},
+    {ngx_string("Content-Language"), ngx_string("content-language"), 0, NULL},
+    {ngx_string("Content-Length"),   ngx_string("content-length"), 0, NULL},
+    {ngx_string("Date"),             ngx_string("date"), 0, NULL},
+    {ngx_string("Last-Modified"),    ngx_string("last-modified"), 0, NULL},
+    {ngx_string("Location"),         ngx_string("location"), 0, NULL},
+    {ngx_string("Set-Cookie"),       ngx_string("set-cookie"), 0, NULL},
+    {ngx_string("Set-Cookie2"),      ngx_string("set-cookie2"), 0, NULL},
+    {ngx_string("Servlet-Engine"),   ngx_string("servlet-engine"), 0, NULL},
+    {ngx_string("Status"),           ngx_string("status"), 0, NULL},
+    {ngx_string("WWW-Authenticate"), ngx_string("www-authenticate"), 0, NULL},
+    {ngx_null_string, ngx_null_string, 0, NULL}
 };
 
 
-/* This will be called in the ajp_module's init_process function. */
-void
-ajp_header_init(void)
-{
-    request_known_headers_calc_hash();
-    response_known_headers_calc_hash();
-}
-
+/*
+ * The status lines most responses carry, with the reason phrases of
+ * Tomcat. A matching status line is referenced instead of being copied.
+ */
+typedef struct {
+    ngx_uint_t                   status;
+    ngx_str_t                    line;
+} response_status_line_t;
+
+static response_status_line_t  response_status_lines[] = {
+    { 200, ngx_string("200 OK") },
+    { 201, ngx_string("201 Created") },
+    { 204, ngx_string("204 No Content") },
+    { 206, ngx_string("206 Partial Content") },
+    { 301, ngx_string("301 Moved Permanently") },
+    { 302, ngx_string("302 Found") },
+    { 302, ngx_string("302 Moved Temporarily") },
+    { 303, ngx_string("303 See Other") },
+    { 304, ngx_string("304 Not Modified") },
+    { 307, ngx_string("307 Temporary Redirect") },
+    { 400, ngx_string("400 Bad Request") },
+    { 401, ngx_string("401 Unauthorized") },
+    { 403, ngx_string("403 Forbidden") },
+    { 404, ngx_string("404 Not Found") },
+    { 405, ngx_string("405 Method Not Allowed") },
+    { 500, ngx_string("500 Internal Server Error") },
+    { 502, ngx_string("502 Bad Gateway") },
+    { 503, ngx_string("503 Service Unavailable") },
+    { 0, ngx_null_string }
+};
 
-static void
-request_known_headers_calc_hash (void)
-{
-    static ngx_int_t         is_calc_request_hash = 0;
-    request_known_headers_t *header;
 
-    if (is_calc_request_hash) {
-        return;
-    }
+/*
+ * The names of the other response headers are interned per worker, as
+ * the backends send the same few names in every response. The table is
+ * never evicted, the requests still refer to its names. Once it is full,
+ * the new names are lowercased for each response.
+ */
+#define AJP_RES_INTERN_SIZE      128
+#define AJP_RES_INTERN_MAX       64
+#define AJP_RES_INTERN_NAME_LEN  64
 
-    is_calc_request_hash = 1;
+typedef struct {
+    ngx_str_t                    name;
+    u_char                      *lowcase_name;
+    ngx_uint_t                   hash;
+    /* the hash of the name as it was sent */
+    ngx_uint_t                   key;
+    ngx_http_upstream_header_t  *hh;
+} response_interned_header_t;
 
-    header = request_known_headers;
+static response_interned_header_t
+    response_interned_headers[AJP_RES_INTERN_SIZE];
+static ngx_uint_t  response_interned_headers_n;
 
-    while (header->name.len != 0) {
-        header->hash = ngx_hash_key(header->name.data, header->name.len);
 
-        header++;
-    }
+/* This will be called in the ajp_module's init_process function. */
+void
+ajp_header_init(ngx_http_upstream_main_conf_t *umcf)
+{
+    response_known_headers_calc_hash(umcf);
 }
 
 
+/*
+ * The hash and the upstream handler of the coded response headers are
+ * known once, they are not looked up for each response.
+ */
 static void
-response_known_headers_calc_hash(void)
+response_known_headers_calc_hash(ngx_http_upstream_main_conf_t *umcf)
 {
     static ngx_int_t          is_calc_response_hash = 0;
     response_known_headers_t *header;
@@ -110,22 +125,14 @@ response_known_headers_calc_hash(void)
         header->hash =
             ngx_hash_key(header->lowcase_name.data, header->lowcase_name.len);
 
-        header++;
-    }
-}
-
-
-static ngx_uint_t
-sc_for_req_get_headers_num(ngx_list_part_t *part)
-{
-    ngx_uint_t num = 0;
+        if (umcf) {
+            header->hh = ngx_hash_find(&umcf->headers_in_hash, header->hash,
+                                       header->lowcase_name.data,
+                                       header->lowcase_name.len);
+        }
 
-    while (part) {
-        num += part->nelts;
-        part = part->next;
+        header++;
     }
-
-    return num;
 }
 
 
@@ -160,36 +167,129 @@ sc_for_req_get_uri(ngx_http_request_t *r, ngx_str_t *uri)
 }
 
 
-static ngx_int_t
-request_known_headers_find_hash (ngx_uint_t hash)
+#define sc_for_req_match(p, s)  (ngx_strncmp(p, s, sizeof(s) - 1) == 0)
+
+
+/*
+ * The length and one distinguishing character select at most one candidate
+ * among the known request headers, the full name is verified afterwards.
+ */
+static int
+sc_for_req_header(ngx_table_elt_t *header)
 {
-    request_known_headers_t *header;
+    u_char  *p;
 
-    header = request_known_headers;
+    p = header->lowcase_key;
 
-    while (header->name.len != 0) {
-        if (header->hash == hash) {
-            return header->code;
+    switch (header->key.len) {
+
+    case 4:
+        if (sc_for_req_match(p, "host")) {
+            return SC_REQ_HOST;
         }
+        break;
 
-        header++;
-    }
+    case 6:
+        switch (p[0]) {
+        case 'a':
+            if (sc_for_req_match(p, "accept")) {
+                return SC_REQ_ACCEPT;
+            }
+            break;
 
-    return UNKNOWN_METHOD;
-}
+        case 'c':
+            if (sc_for_req_match(p, "cookie")) {
+                return SC_REQ_COOKIE;
+            }
+            break;
 
+        case 'p':
+            if (sc_for_req_match(p, "pragma")) {
+                return SC_REQ_PRAGMA;
+            }
+            break;
+        }
+        break;
 
-static int
-sc_for_req_header(ngx_table_elt_t *header)
-{
-    size_t len = header->key.len;
+    case 7:
+        switch (p[0]) {
+        case 'c':
+            if (sc_for_req_match(p, "cookie2")) {
+                return SC_REQ_COOKIE2;
+            }
+            break;
 
-    /* ACCEPT-LANGUAGE is the longest header */
-    if (len < 4 || len > 15) {
-        return UNKNOWN_METHOD;
+        case 'r':
+            if (sc_for_req_match(p, "referer")) {
+                return SC_REQ_REFERER;
+            }
+            break;
+        }
+        break;
+
+    case 10:
+        switch (p[0]) {
+        case 'c':
+            if (sc_for_req_match(p, "connection")) {
+                return SC_REQ_CONNECTION;
+            }
+            break;
+
+        case 'u':
+            if (sc_for_req_match(p, "user-agent")) {
+                return SC_REQ_USER_AGENT;
+            }
+            break;
+        }
+        break;
+
+    case 12:
+        if (sc_for_req_match(p, "content-type")) {
+            return SC_REQ_CONTENT_TYPE;
+        }
+        break;
+
+    case 13:
+        if (sc_for_req_match(p, "authorization")) {
+            return SC_REQ_AUTHORIZATION;
+        }
+        break;
+
+    case 14:
+        switch (p[0]) {
+        case 'a':
+            if (sc_for_req_match(p, "accept-charset")) {
+                return SC_REQ_ACCEPT_CHARSET;
+            }
+            break;
+
+        case 'c':
+            if (sc_for_req_match(p, "content-length")) {
+                return SC_REQ_CONTENT_LENGTH;
+            }
+            break;
+        }
+        break;
+
+    case 15:
+        /* "accept-encoding" and "accept-language" */
+        switch (p[7]) {
+        case 'e':
+            if (sc_for_req_match(p, "accept-encoding")) {
+                return SC_REQ_ACCEPT_ENCODING;
+            }
+            break;
+
+        case 'l':
+            if (sc_for_req_match(p, "accept-language")) {
+                return SC_REQ_ACCEPT_LANGUAGE;
+            }
+            break;
+        }
+        break;
     }
 
-    return (int)request_known_headers_find_hash(header->hash);
+    return UNKNOWN_METHOD;
 }
 
 
@@ -268,103 +368,704 @@ sc_for_req_method_by_id(ngx_http_request_t *r)
 }
 
 
-static void
-sc_for_req_auth_type(ngx_http_request_t *r, ngx_str_t *auth_type)
+static void
+sc_for_req_auth_type(ngx_http_request_t *r, ngx_str_t *auth_type)
+{
+    size_t     i;
+    ngx_str_t *auth;
+
+    auth_type->len = 0;
+
+    if (r->headers_in.authorization == NULL) {
+        return;
+    }
+
+    auth = &r->headers_in.authorization->value;
+
+    for(i = 0; i < auth->len; i++) {
+        if (auth->data[i] == ' ') {
+            break;
+        }
+    }
+
+    if (i > 0) {
+        auth_type->data = auth->data;
+        auth_type->len = i - 1;
+    }
+}
+
+
+static ngx_int_t
+get_res_header_for_sc(int sc, ngx_table_elt_t *h,
+    ngx_http_upstream_header_t **hh)
+{
+    response_known_headers_t *header;
+
+    sc = sc & 0X00FF;
+
+    if(sc <= SC_RES_HEADERS_NUM && sc > 0) {
+        header = &response_known_headers[sc - 1];
+        h->key = header->name;
+        h->lowcase_key = header->lowcase_name.data;
+        h->hash = header->hash;
+        *hh = header->hh;
+
+    } else {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+get_res_unknown_header_by_str(ngx_str_t *name, ngx_table_elt_t *h,
+    ngx_http_upstream_header_t **hh, ngx_http_upstream_main_conf_t *umcf,
+    ngx_pool_t *pool)
+{
+    u_char                      *p;
+    ngx_uint_t                   key;
+    response_interned_header_t  *ih;
+
+    key = ngx_hash_key(name->data, name->len);
+
+    for (ih = &response_interned_headers[key % AJP_RES_INTERN_SIZE];
+         ih->name.len;
+         ih = (ih == &response_interned_headers[AJP_RES_INTERN_SIZE - 1])
+              ? response_interned_headers : ih + 1)
+    {
+        if (ih->key == key
+            && ih->name.len == name->len
+            && ngx_memcmp(ih->name.data, name->data, name->len) == 0)
+        {
+            h->key = ih->name;
+            h->lowcase_key = ih->lowcase_name;
+            h->hash = ih->hash;
+            *hh = ih->hh;
+            return NGX_OK;
+        }
+    }
+
+    /* ih is the free slot the name would take */
+
+    if (response_interned_headers_n < AJP_RES_INTERN_MAX
+        && name->len <= AJP_RES_INTERN_NAME_LEN)
+    {
+        p = ngx_pnalloc(ngx_cycle->pool, 2 * name->len);
+
+        if (p != NULL) {
+            ih->name.data = p;
+            ih->lowcase_name = ngx_cpymem(p, name->data, name->len);
+            ih->hash = ngx_hash_strlow(ih->lowcase_name, p, name->len);
+            ih->key = key;
+            ih->hh = ngx_hash_find(&umcf->headers_in_hash, ih->hash,
+                                   ih->lowcase_name, name->len);
+
+            /* the slot is in use once the length is set */
+            ih->name.len = name->len;
+            response_interned_headers_n++;
+
+            h->key = ih->name;
+            h->lowcase_key = ih->lowcase_name;
+            h->hash = ih->hash;
+            *hh = ih->hh;
+            return NGX_OK;
+        }
+    }
+
+    h->key = *name;
+
+    h->lowcase_key = ngx_pnalloc(pool, h->key.len);
+    if (h->lowcase_key == NULL) {
+        return NGX_ERROR;
+    }
+
+    h->hash = ngx_hash_strlow(h->lowcase_key, h->key.data, h->key.len);
+
+    *hh = ngx_hash_find(&umcf->headers_in_hash, h->hash,
+                        h->lowcase_key, h->key.len);
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+get_res_status_line(ngx_uint_t status, ngx_str_t *reason,
+    ngx_str_t *line, ngx_pool_t *pool)
+{
+    response_status_line_t  *known;
+
+    for (known = response_status_lines; known->status; known++) {
+
+        if (known->status != status) {
+            continue;
+        }
+
+        if (known->line.len - 4 == reason->len
+            && ngx_strncmp(known->line.data + 4, reason->data, reason->len)
+               == 0)
+        {
+            *line = known->line;
+            return NGX_OK;
+        }
+    }
+
+    line->data = ngx_pnalloc(pool, sizeof("65535 ") - 1 + reason->len);
+    if (line->data == NULL) {
+        return NGX_ERROR;
+    }
+
+    line->len = ngx_sprintf(line->data, "%ui %V", status, reason)
+                - line->data;
+
+    return NGX_OK;
+}
+
+#if (NGX_HTTP_SSL)
+
+static ngx_uint_t
+sc_for_req_get_ssl_cert(ngx_connection_t *c, ngx_pool_t *pool, ngx_str_t *data) {
+    ngx_ssl_get_raw_certificate(c, pool, data);
+    return data->len;
+}
+
+static ngx_uint_t
+sc_for_req_get_ssl_cipher(ngx_connection_t *c, ngx_pool_t *pool, ngx_str_t *data) {
+    ngx_ssl_get_cipher_name(c, pool, data);
+    data->len = ngx_strlen(data->data);
+    return data->len;
+}
+
+static ngx_uint_t
+sc_for_req_get_ssl_session(ngx_connection_t *c, ngx_pool_t *pool, ngx_str_t *data) {
+    ngx_ssl_get_session_id(c, pool, data);
+    return data->len;
+}
+
+static ngx_uint_t
+sc_for_req_get_ssl_key_size(ngx_connection_t *c, ngx_pool_t *pool) {
+    int usekeysize = 0, algkeysize = 0;
+    const SSL_CIPHER *cipher;
+
+    if(c->ssl->connection != NULL)
+        if((cipher = SSL_get_current_cipher(c->ssl->connection)) != NULL)
+            usekeysize = SSL_CIPHER_get_bits(cipher, &algkeysize);
+
+    return usekeysize;
+}
+
+
+static int  ajp_ssl_segment_index = -1;
+
+
+static void
+ajp_ssl_segment_free(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx,
+    long argl, void *argp)
+{
+    if (ptr != NULL) {
+        ngx_free(ptr);
+    }
+}
+
+
+/*
+ * The encoded SSL attributes, each of them is empty if it is not available.
+ * They are stored contiguously in this order, "all" covers all of them.
+ */
+typedef struct {
+    ngx_str_t         all;
+    ngx_str_t         cert;
+    ngx_str_t         cipher;
+    ngx_str_t         session;
+    ngx_str_t         key_size;
+} ajp_ssl_segment_t;
+
+
+/*
+ * The SSL attributes never change in one SSL connection, so they are
+ * encoded once and kept with the SSL object, which is shared by all the
+ * requests of the client connection, including HTTP/2 streams.
+ */
+static ajp_ssl_segment_t *
+sc_for_req_get_ssl_segment(ngx_http_request_t *r)
+{
+    SSL               *ssl;
+    size_t             size;
+    ajp_msg_t          msg;
+    ngx_buf_t          buf;
+    ngx_uint_t         keysize;
+    ngx_pool_t        *pool;
+    ngx_str_t          cert_str, cipher_str, session_str;
+    ngx_connection_t  *c;
+    ajp_ssl_segment_t *segment;
+
+    c = r->connection;
+    pool = r->pool;
+
+    if (c->ssl == NULL || c->ssl->connection == NULL) {
+        return NULL;
+    }
+
+    ssl = c->ssl->connection;
+
+    if (ajp_ssl_segment_index != -1) {
+        segment = SSL_get_ex_data(ssl, ajp_ssl_segment_index);
+        if (segment != NULL) {
+            return segment;
+        }
+    }
+
+    ajp_msg_reuse(&msg);
+
+    /*
+     * Ensure that only variables get set in the AJP message
+     * that are not NULL and not empty.
+     */
+    size = 0;
+
+    if (sc_for_req_get_ssl_cert(c, pool, &cert_str) > 0) {
+        size += 1 + ajp_msg_size_string(&msg, &cert_str);
+    }
+
+    if (sc_for_req_get_ssl_cipher(c, pool, &cipher_str) > 0) {
+        size += 1 + ajp_msg_size_string(&msg, &cipher_str);
+    }
+
+    if (sc_for_req_get_ssl_session(c, pool, &session_str) > 0) {
+        size += 1 + ajp_msg_size_string(&msg, &session_str);
+    }
+
+    /* ssl_key_size is required by Servlet 2.3 API */
+    if ((keysize = sc_for_req_get_ssl_key_size(c, pool)) > 0) {
+        size += 1 + 2;
+    }
+
+    segment = ngx_alloc(sizeof(ajp_ssl_segment_t) + size, c->log);
+    if (segment == NULL) {
+        return NULL;
+    }
+
+    ngx_memzero(&buf, sizeof(ngx_buf_t));
+    buf.start = buf.pos = buf.last = (u_char *) &segment[1];
+    buf.end = buf.start + size;
+
+    msg.buf = &buf;
+
+    segment->cert.data = buf.last;
+    if (cert_str.len > 0) {
+        ajp_msg_put_uint8(&msg, SC_A_SSL_CERT);
+        ajp_msg_put_string(&msg, &cert_str);
+    }
+    segment->cert.len = buf.last - segment->cert.data;
+
+    segment->cipher.data = buf.last;
+    if (cipher_str.len > 0) {
+        ajp_msg_put_uint8(&msg, SC_A_SSL_CIPHER);
+        ajp_msg_put_string(&msg, &cipher_str);
+    }
+    segment->cipher.len = buf.last - segment->cipher.data;
+
+    segment->session.data = buf.last;
+    if (session_str.len > 0) {
+        ajp_msg_put_uint8(&msg, SC_A_SSL_SESSION);
+        ajp_msg_put_string(&msg, &session_str);
+    }
+    segment->session.len = buf.last - segment->session.data;
+
+    segment->key_size.data = buf.last;
+    if (keysize > 0) {
+        ajp_msg_put_uint8(&msg, SC_A_SSL_KEY_SIZE);
+        ajp_msg_put_uint16(&msg, (uint16_t) keysize);
+    }
+    segment->key_size.len = buf.last - segment->key_size.data;
+
+    segment->all.data = buf.start;
+    segment->all.len = size;
+
+    if (ajp_ssl_segment_index == -1
+        || SSL_set_ex_data(ssl, ajp_ssl_segment_index, segment) == 0)
+    {
+        ngx_free(segment);
+
+        ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                      "sc_for_req_get_ssl_segment: SSL_set_ex_data() failed");
+        return NULL;
+    }
+
+    return segment;
+}
+
+
+/* the selected attributes of the segment, called by both passes */
+static size_t
+sc_for_req_ssl_segment(ajp_msg_t *msg, ajp_ssl_segment_t *segment,
+    ngx_uint_t attrs, ngx_uint_t put)
+{
+    size_t      size;
+    ngx_uint_t  i;
+    ngx_str_t  *pieces[4];
+    ngx_uint_t  masks[4] = {
+        NGX_HTTP_AJP_ATTR_SSL_CERT, NGX_HTTP_AJP_ATTR_SSL_CIPHER,
+        NGX_HTTP_AJP_ATTR_SSL_SESSION, NGX_HTTP_AJP_ATTR_SSL_KEY_SIZE
+    };
+
+    if ((attrs & NGX_HTTP_AJP_ATTR_SSL) == NGX_HTTP_AJP_ATTR_SSL) {
+        if (put) {
+            ajp_msg_put_bytes(msg, &segment->all);
+            return 0;
+        }
+
+        return ajp_msg_size_bytes(msg, &segment->all);
+    }
+
+    pieces[0] = &segment->cert;
+    pieces[1] = &segment->cipher;
+    pieces[2] = &segment->session;
+    pieces[3] = &segment->key_size;
+
+    size = 0;
+
+    for (i = 0; i < 4; i++) {
+        if (!(attrs & masks[i])) {
+            continue;
+        }
+
+        if (put) {
+            ajp_msg_put_bytes(msg, pieces[i]);
+
+        } else {
+            size += ajp_msg_size_bytes(msg, pieces[i]);
+        }
+    }
+
+    return size;
+}
+
+#endif
+
+
+/* This will be called in the ajp_module's init_process function. */
+ngx_int_t
+ajp_ssl_init(void)
+{
+#if (NGX_HTTP_SSL)
+
+    if (ajp_ssl_segment_index != -1) {
+        return NGX_OK;
+    }
+
+    ajp_ssl_segment_index = SSL_get_ex_new_index(0, NULL, NULL, NULL,
+                                                 ajp_ssl_segment_free);
+
+    if (ajp_ssl_segment_index == -1) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                      "ajp_ssl_init: SSL_get_ex_new_index() failed");
+        return NGX_ERROR;
+    }
+
+#endif
+
+    return NGX_OK;
+}
+
+/* method, protocol string and the AJP_REMOTE_PORT attribute name */
+#define AJP_TEMPLATE_BUFFER_SZ  64
+
+
+static u_char *
+ajp_template_head(ajp_msg_t *msg, ngx_str_t *protocol, ngx_str_t *head)
+{
+    head->data = msg->buf->last;
+
+    /* the method is patched per request */
+    if (ajp_msg_append_uint8(msg, CMD_AJP13_FORWARD_REQUEST) ||
+            ajp_msg_append_uint8(msg, 0)                     ||
+            ajp_msg_append_string(msg, protocol)) {
+        return NULL;
+    }
+
+    head->len = msg->buf->last - head->data;
+
+    return head->data;
+}
+
+
+/* the template does not depend on the configuration, it is built once */
+static u_char                   ajp_template_buffer[AJP_TEMPLATE_BUFFER_SZ];
+static ngx_http_ajp_template_t  ajp_template;
+
+
+ngx_int_t
+ajp_template_init(void)
+{
+    ajp_msg_t                 msg;
+    ngx_buf_t                 buf;
+    ngx_str_t                 str;
+    ngx_http_ajp_template_t  *tmpl;
+
+    tmpl = &ajp_template;
+
+    if (tmpl->head11.len) {
+        return NGX_OK;
+    }
+
+    ngx_memzero(&buf, sizeof(ngx_buf_t));
+
+    buf.start = ajp_template_buffer;
+    buf.end = ajp_template_buffer + AJP_TEMPLATE_BUFFER_SZ;
+
+    ajp_msg_reuse(&msg);
+    msg.buf = &buf;
+
+    ajp_msg_reset(&msg);
+
+    ngx_str_set(&str, "HTTP/1.1");
+    if (ajp_template_head(&msg, &str, &tmpl->head11) == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_str_set(&str, "HTTP/1.0");
+    if (ajp_template_head(&msg, &str, &tmpl->head10) == NULL) {
+        return NGX_ERROR;
+    }
+
+    tmpl->remote_port.data = msg.buf->last;
+
+    ngx_str_set(&str, SC_A_REQ_REMOTE_PORT);
+    if (ajp_msg_append_uint8(&msg, SC_A_REQ_ATTRIBUTE) ||
+            ajp_msg_append_string(&msg, &str)) {
+        return NGX_ERROR;
+    }
+
+    tmpl->remote_port.len = msg.buf->last - tmpl->remote_port.data;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ajp_param_init(ngx_pool_t *pool, ngx_http_ajp_param_t *param,
+    ngx_str_t *name, ngx_str_t *value)
+{
+    size_t     size;
+    ajp_msg_t  msg;
+
+    ajp_msg_reuse(&msg);
+
+    size = AJP_HEADER_LEN + 1 + 2 + name->len + 1;
+
+    if (value != NULL) {
+        size += 2 + value->len + 1;
+    }
+
+    if (ajp_msg_create_buffer(pool, size, &msg) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ajp_msg_reset(&msg);
+
+    param->key.data = msg.buf->last;
+
+    if (ajp_msg_append_uint8(&msg, SC_A_REQ_ATTRIBUTE) ||
+            ajp_msg_append_string(&msg, name)) {
+        return NGX_ERROR;
+    }
+
+    if (value != NULL && ajp_msg_append_string(&msg, value)) {
+        return NGX_ERROR;
+    }
+
+    param->key.len = msg.buf->last - param->key.data;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ajp_set_header_init(ngx_pool_t *pool, ngx_http_ajp_param_t *param,
+    ngx_str_t *name, ngx_str_t *value)
+{
+    int              sc;
+    size_t           size;
+    ajp_msg_t        msg;
+    ngx_table_elt_t  h;
+
+    h.key = *name;
+    h.lowcase_key = param->name.data;
+
+    sc = sc_for_req_header(&h);
+
+    ajp_msg_reuse(&msg);
+
+    size = AJP_HEADER_LEN + 2 + name->len + 1;
+
+    if (value != NULL) {
+        size += 2 + value->len + 1;
+    }
+
+    if (ajp_msg_create_buffer(pool, size, &msg) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ajp_msg_reset(&msg);
+
+    param->key.data = msg.buf->last;
+
+    if (sc != UNKNOWN_METHOD) {
+        if (ajp_msg_append_uint16(&msg, (uint16_t) sc)) {
+            return NGX_ERROR;
+        }
+
+    } else if (ajp_msg_append_string(&msg, name)) {
+        return NGX_ERROR;
+    }
+
+    if (value != NULL && ajp_msg_append_string(&msg, value)) {
+        return NGX_ERROR;
+    }
+
+    param->key.len = msg.buf->last - param->key.data;
+
+    return NGX_OK;
+}
+
+
+static ngx_str_t *
+ajp_template_get_head(ngx_http_request_t *r)
 {
-    size_t     i;
-    ngx_str_t *auth;
+    ngx_str_t                *protocol;
+    ngx_http_ajp_template_t  *tmpl;
 
-    auth_type->len = 0;
+    tmpl = &ajp_template;
 
-    if (r->headers_in.authorization == NULL) {
-        return;
-    }
+    protocol = &r->http_protocol;
 
-    auth = &r->headers_in.authorization->value;
+    if (protocol->len != sizeof("HTTP/1.1") - 1) {
+        return NULL;
+    }
 
-    for(i = 0; i < auth->len; i++) {
-        if (auth->data[i] == ' ') {
-            break;
-        }
+    if (ngx_strncmp(protocol->data, "HTTP/1.1", protocol->len) == 0) {
+        return &tmpl->head11;
     }
 
-    if (i > 0) {
-        auth_type->data = auth->data;
-        auth_type->len = i - 1;
+    if (ngx_strncmp(protocol->data, "HTTP/1.0", protocol->len) == 0) {
+        return &tmpl->head10;
     }
+
+    return NULL;
 }
 
 
-static ngx_int_t
-get_res_header_for_sc(int sc, ngx_table_elt_t *h)
+/* whether a request header is passed by the "headers_in_hash" */
+static ngx_uint_t
+sc_for_req_header_passed(ngx_http_ajp_loc_conf_t *alcf, ngx_table_elt_t *h)
 {
-    response_known_headers_t *header;
+    ngx_uint_t  action;
 
-    sc = sc & 0X00FF;
+    if (alcf->headers_in_hash.buckets == NULL) {
+        return 1;
+    }
 
-    if(sc <= SC_RES_HEADERS_NUM && sc > 0) {
-        header = &response_known_headers[sc - 1];
-        h->key = header->name;
-        h->lowcase_key = header->lowcase_name.data;
-        h->hash = header->hash;
+    action = (ngx_uint_t) ngx_hash_find(&alcf->headers_in_hash, h->hash,
+                                        h->lowcase_key, h->key.len);
 
-    } else {
-        return NGX_ERROR;
+    if (action == 0) {
+        return !alcf->headers_in_allow;
     }
 
-    return NGX_OK;
+    return action == NGX_HTTP_AJP_HEADER_IN_PASS;
 }
 
 
+/*
+ * Evaluate the variable values of "ajp_param" or "ajp_set_header", and
+ * size the ones that are sent, counted in n if it is not NULL.
+ */
 static ngx_int_t
-get_res_unknown_header_by_str(ngx_str_t *name,
-    ngx_table_elt_t *h, ngx_pool_t *pool)
+sc_for_req_params_size(ngx_http_request_t *r, ajp_msg_t *msg,
+    ngx_array_t *params, ngx_str_t **values, size_t *size, ngx_uint_t *n)
 {
-    h->key = *name;
+    ngx_str_t             *v;
+    ngx_uint_t             i;
+    ngx_http_ajp_param_t  *param;
 
-    h->lowcase_key = ngx_pnalloc(pool, h->key.len);
-    if (h->lowcase_key == NULL) {
-        return NGX_ERROR;
+    v = NULL;
+
+    param = params->elts;
+
+    for (i = 0; i < params->nelts; i++) {
+
+        if (param[i].value == NULL) {
+            if (param[i].key.len == 0) {
+                continue;
+            }
+
+            *size += ajp_msg_size_bytes(msg, &param[i].key);
+
+            if (n) {
+                (*n)++;
+            }
+
+            continue;
+        }
+
+        if (v == NULL) {
+            v = ngx_pcalloc(r->pool, params->nelts * sizeof(ngx_str_t));
+            if (v == NULL) {
+                return NGX_ERROR;
+            }
+        }
+
+        if (ngx_http_complex_value(r, param[i].value, &v[i]) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        if (v[i].len == 0 && param[i].skip_empty) {
+            continue;
+        }
+
+        *size += ajp_msg_size_bytes(msg, &param[i].key)
+                 + ajp_msg_size_string(msg, &v[i]);
+
+        if (n) {
+            (*n)++;
+        }
     }
 
-    h->hash = ngx_hash_strlow(h->lowcase_key, h->key.data, h->key.len);
+    *values = v;
+
     return NGX_OK;
 }
 
-#if (NGX_HTTP_SSL)
 
-static ngx_uint_t
-sc_for_req_get_ssl_cert(ngx_connection_t *c, ngx_pool_t *pool, ngx_str_t *data) {
-    ngx_ssl_get_raw_certificate(c, pool, data);
-    return data->len;
-}
+static void
+sc_for_req_put_params(ajp_msg_t *msg, ngx_array_t *params, ngx_str_t *values,
+    ngx_log_t *log)
+{
+    ngx_uint_t             i;
+    ngx_http_ajp_param_t  *param;
 
-static ngx_uint_t
-sc_for_req_get_ssl_cipher(ngx_connection_t *c, ngx_pool_t *pool, ngx_str_t *data) {
-    ngx_ssl_get_cipher_name(c, pool, data);
-    data->len = ngx_strlen(data->data);
-    return data->len;
-}
+    param = params->elts;
 
-static ngx_uint_t
-sc_for_req_get_ssl_session(ngx_connection_t *c, ngx_pool_t *pool, ngx_str_t *data) {
-    ngx_ssl_get_session_id(c, pool, data);
-    return data->len;
-}
+    for (i = 0; i < params->nelts; i++) {
 
-static ngx_uint_t
-sc_for_req_get_ssl_key_size(ngx_connection_t *c, ngx_pool_t *pool) {
-    int usekeysize = 0, algkeysize = 0;
-    const SSL_CIPHER *cipher;
+        if (param[i].value == NULL) {
+            ajp_msg_put_bytes(msg, &param[i].key);
+            continue;
+        }
 
-    if(c->ssl->connection != NULL)
-        if((cipher = SSL_get_current_cipher(c->ssl->connection)) != NULL)
-            usekeysize = SSL_CIPHER_get_bits(cipher, &algkeysize);
+        if (values[i].len == 0 && param[i].skip_empty) {
+            continue;
+        }
 
-    return usekeysize;
+        ajp_msg_put_bytes(msg, &param[i].key);
+        ajp_msg_put_string(msg, &values[i]);
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "ajp_marshal_into_msgb: param[%ui] \"%V\"",
+                       i, &values[i]);
+    }
 }
 
-#endif
 
 /*
  Message structure
@@ -402,15 +1103,21 @@ ajp_marshal_into_msgb(ajp_msg_t *msg,
 {
     int                  sc;
     int                  method;
-    u_char               is_ssl = 0;
-    uint16_t             port;
+    u_char               is_ssl = 0, *p, buf[6];
+    size_t               size, total;
+    uint16_t             port, remote_port;
     ngx_str_t            uri, *remote_host, *remote_addr;
-    ngx_str_t            temp_str, *jvm_route, port_str;
+    ngx_str_t            auth_type, *jvm_route, port_str, *head;
     ngx_log_t           *log;
     ngx_uint_t           i, num_headers = 0;
     ngx_list_part_t     *part;
     ngx_table_elt_t     *header;
     struct sockaddr_in  *addr;
+    ngx_uint_t           attrs;
+    ngx_str_t           *values, *set_values;
+#if (NGX_HTTP_SSL)
+    ajp_ssl_segment_t   *ssl_segment = NULL;
+#endif
 
     log = r->connection->log;
 
@@ -426,11 +1133,12 @@ ajp_marshal_into_msgb(ajp_msg_t *msg,
 
     part = &r->headers_in.headers.part;
 
-    if (alcf->upstream.pass_request_headers) {
-        num_headers = sc_for_req_get_headers_num(part);
-    }
+    attrs = alcf->forward_attributes;
 
-    remote_host = remote_addr = &r->connection->addr_text;
+    remote_addr = &r->connection->addr_text;
+
+    /* the null string lets the container fall back to remote_addr */
+    remote_host = (attrs & NGX_HTTP_AJP_ATTR_REMOTE_HOST) ? remote_addr : NULL;
 
     addr = (struct sockaddr_in *) r->connection->local_sockaddr;
     /*'struct sockaddr_in' and 'struct sockaddr_in6' has the same offset of port*/
@@ -444,28 +1152,31 @@ ajp_marshal_into_msgb(ajp_msg_t *msg,
                    "Into ajp_marshal_into_msgb, uri: \"%V\", version: \"%V\"",
                    &uri, &r->http_protocol);
 
-    ajp_msg_reset(msg);
+    /*
+     * The first pass collects the values and computes the exact size of
+     * the packet, the second pass writes it without any bound check.
+     * The strings must be sized and put in the same order, which matters
+     * in the gather mode.
+     */
 
-    if (ajp_msg_append_uint8(msg, CMD_AJP13_FORWARD_REQUEST)  ||
-            ajp_msg_append_uint8(msg, (u_char) method)        ||
-            ajp_msg_append_string(msg, &r->http_protocol)     ||
-            ajp_msg_append_string(msg, &uri)                  ||
-            ajp_msg_append_string(msg, remote_addr)           ||
-            ajp_msg_append_string(msg, remote_host)           ||
-            ajp_msg_append_string(msg, &r->headers_in.server) ||
-            ajp_msg_append_uint16(msg, port)                  ||
-            ajp_msg_append_uint8(msg, is_ssl)                 ||
-            ajp_msg_append_uint16(msg, (uint16_t) num_headers)) {
+    head = ajp_template_get_head(r);
 
-        ngx_log_error(NGX_LOG_ERR, log, 0,
-                      "ajp_marshal_into_msgb: "
-                      "Error appending the message begining");
-        return AJP_EOVERFLOW;
+    if (head != NULL) {
+        size = head->len;
+
+    } else {
+        size = 1 + 1 + ajp_msg_size_string(msg, &r->http_protocol);
     }
 
-    header = part->elts;
+    size += ajp_msg_size_string(msg, &uri)
+            + ajp_msg_size_string(msg, remote_addr)
+            + ajp_msg_size_string(msg, remote_host)
+            + ajp_msg_size_string(msg, &r->headers_in.server)
+            + 2 + 1 + 2;
+
     if (alcf->upstream.pass_request_headers) {
 
+        header = part->elts;
         for (i = 0; /* void */; i++) {
             if (i >= part->nelts) {
                 if (part->next == NULL) {
@@ -477,21 +1188,19 @@ ajp_marshal_into_msgb(ajp_msg_t *msg,
                 i = 0;
             }
 
-            if ((sc = sc_for_req_header(&header[i])) != UNKNOWN_METHOD) {
-                if (ajp_msg_append_uint16(msg, (uint16_t)sc)) {
-                    ngx_log_error(NGX_LOG_ERR, log, 0,
-                                  "ajp_marshal_into_msgb: "
-                                  "Error appending the header name");
-                    return AJP_EOVERFLOW;
-                }
+            if (!sc_for_req_header_passed(alcf, &header[i])) {
+                continue;
             }
-            else {
-                if (ajp_msg_append_string(msg, &header[i].key)) {
-                    ngx_log_error(NGX_LOG_ERR, log, 0,
-                                  "ajp_marshal_into_msgb: "
-                                  "Error appending the header name");
-                    return AJP_EOVERFLOW;
-                }
+
+            num_headers++;
+
+            sc = sc_for_req_header(&header[i]);
+
+            if (sc != UNKNOWN_METHOD) {
+                size += 2;
+
+            } else {
+                size += ajp_msg_size_string(msg, &header[i].key);
             }
 
             if (sc == SC_REQ_CONNECTION) {
@@ -505,119 +1214,63 @@ ajp_marshal_into_msgb(ajp_msg_t *msg,
                 }
             }
 
-            if (ajp_msg_append_string(msg, &header[i].value)) {
-                ngx_log_error(NGX_LOG_ERR, log, 0,
-                              "ajp_marshal_into_msgb: "
-                              "Error appending the header value");
-                return AJP_EOVERFLOW;
-            }
-
-            ngx_log_debug4(NGX_LOG_DEBUG_HTTP, log, 0,
-                           "ajp_marshal_into_msgb: Header[%d] [%V] = [%V], size:%z",
-                           i, &header[i].key, &header[i].value, ngx_buf_size(msg->buf));
+            size += ajp_msg_size_string(msg, &header[i].value);
         }
     }
 
-    if (r->headers_in.user.len != 0) {
-        if (ajp_msg_append_uint8(msg, SC_A_REMOTE_USER) ||
-                ajp_msg_append_string(msg, &r->headers_in.user)) {
-            ngx_log_error(NGX_LOG_ERR, log, 0,
-                          "ajp_marshal_into_msgb: "
-                          "Error appending the remote user");
-            return AJP_EOVERFLOW;
-        }
-    }
+    set_values = NULL;
 
-    sc_for_req_auth_type(r, &temp_str);
-    if (temp_str.len > 0) {
-        if (ajp_msg_append_uint8(msg, SC_A_AUTH_TYPE) ||
-                ajp_msg_append_string(msg, &temp_str))
+    if (alcf->set_headers) {
+        if (sc_for_req_params_size(r, msg, alcf->set_headers, &set_values,
+                                   &size, &num_headers)
+            != NGX_OK)
         {
-            ngx_log_error(NGX_LOG_ERR, log, 0,
-                          "ajp_marshal_into_msgb: "
-                          "Error appending the auth type");
-            return AJP_EOVERFLOW;
+            return NGX_ERROR;
         }
     }
 
-    if (r->args.len > 0) {
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
-                       "ajp_marshal_into_msgb: append_args=\"%V\"", &r->args);
+    if ((attrs & NGX_HTTP_AJP_ATTR_REMOTE_USER)
+        && r->headers_in.user.len != 0)
+    {
+        size += 1 + ajp_msg_size_string(msg, &r->headers_in.user);
+    }
 
-        if (ajp_msg_append_uint8(msg, SC_A_QUERY_STRING) ||
-                ajp_msg_append_string(msg, &r->args)) {
-            ngx_log_error(NGX_LOG_ERR, log, 0,
-                          "ajp_marshal_into_msgb: "
-                          "Error appending the query string");
-            return AJP_EOVERFLOW;
-        }
+    auth_type.len = 0;
+
+    if (attrs & NGX_HTTP_AJP_ATTR_AUTH_TYPE) {
+        sc_for_req_auth_type(r, &auth_type);
+    }
+
+    if (auth_type.len > 0) {
+        size += 1 + ajp_msg_size_string(msg, &auth_type);
     }
 
-    jvm_route = sc_for_req_get_header_vaule_by_hash(&r->headers_in.headers.part,
+    if (r->args.len > 0) {
+        size += 1 + ajp_msg_size_string(msg, &r->args);
+    }
+
+    jvm_route = NULL;
+
+    if (attrs & NGX_HTTP_AJP_ATTR_JVM_ROUTE) {
+        jvm_route = sc_for_req_get_header_vaule_by_hash(
+                        &r->headers_in.headers.part,
                         (u_char *)"session-route", sizeof("session-route") - 1);
+    }
+
     if (jvm_route != NULL) {
-        if (ajp_msg_append_uint8(msg, SC_A_JVM_ROUTE) ||
-                ajp_msg_append_string(msg, jvm_route)) {
-            ngx_log_error(NGX_LOG_ERR, log, 0,
-                          "ajp_marshal_into_msgb: "
-                          "Error appending the jvm route");
-            return AJP_EOVERFLOW;
-        }
+        size += 1 + ajp_msg_size_string(msg, jvm_route);
     }
 
 #if (NGX_HTTP_SSL)
 
-    /*
-     * Only lookup SSL variables if we are currently running HTTPS.
-     * Furthermore ensure that only variables get set in the AJP message
-     * that are not NULL and not empty.
-     */
-    if(is_ssl) {
-        ngx_connection_t *c = r->connection;
-        ngx_pool_t *pool = r->pool;
-        ngx_uint_t keysize;
-        ngx_str_t cert_str, cipher_str, session_str;
-
-        if(sc_for_req_get_ssl_cert(c, pool, &cert_str) > 0) {
-            if (ajp_msg_append_uint8(msg, SC_A_SSL_CERT) ||
-                    ajp_msg_append_string(msg, &cert_str)) {
-                ngx_log_error(NGX_LOG_ERR, log, 0,
-                              "ajp_marshal_into_msgb: "
-                              "Error appending the SSL certificates");
-                return AJP_EOVERFLOW;
-            }
-        }
-
-        if(sc_for_req_get_ssl_cipher(c, pool, &cipher_str) > 0) {
-            if (ajp_msg_append_uint8(msg, SC_A_SSL_CIPHER) ||
-                    ajp_msg_append_string(msg, &cipher_str)) {
-                ngx_log_error(NGX_LOG_ERR, log, 0,
-                              "ajp_marshal_into_msgb: "
-                              "Error appending the SSL ciphers");
-                return AJP_EOVERFLOW;
-            }
-        }
-
-        if(sc_for_req_get_ssl_session(c, pool, &session_str) > 0) {
-            if (ajp_msg_append_uint8(msg, SC_A_SSL_SESSION) ||
-                    ajp_msg_append_string(msg, &session_str)) {
-                ngx_log_error(NGX_LOG_ERR, log, 0,
-                              "ajp_marshal_into_msgb: "
-                              "Error appending the SSL session");
-                return AJP_EOVERFLOW;
-            }
+    /* Only lookup SSL variables if we are currently running HTTPS. */
+    if (is_ssl && (attrs & NGX_HTTP_AJP_ATTR_SSL)) {
+        ssl_segment = sc_for_req_get_ssl_segment(r);
+        if (ssl_segment == NULL) {
+            return NGX_ERROR;
         }
 
-        /* ssl_key_size is required by Servlet 2.3 API */
-        if((keysize = sc_for_req_get_ssl_key_size(c, pool)) > 0) {
-            if (ajp_msg_append_uint8(msg, SC_A_SSL_KEY_SIZE) ||
-                    ajp_msg_append_uint16(msg, (uint16_t) keysize)) {
-                ngx_log_error(NGX_LOG_ERR, log, 0,
-                              "ajp_marshal_into_msgb: "
-                              "Error appending the SSL key size");
-                return AJP_EOVERFLOW;
-            }
-        }
+        size += sc_for_req_ssl_segment(msg, ssl_segment, attrs, 0);
     }
 #endif
 
@@ -628,46 +1281,173 @@ ajp_marshal_into_msgb(ajp_msg_t *msg,
      * attribute. Modern Tomcat versions know how to retrieve
      * the remote port from this attribute.
      */
-    {
-        u_char buf[6] = {0};
-        temp_str.data = (u_char *)SC_A_REQ_REMOTE_PORT;
-        temp_str.len = sizeof(SC_A_REQ_REMOTE_PORT) - 1;
-
+    if (attrs & NGX_HTTP_AJP_ATTR_REMOTE_PORT) {
         addr = (struct sockaddr_in *) r->connection->sockaddr;
 
         /*
          * 'struct sockaddr_in' and 'struct sockaddr_in6' has the same
          * offset of port */
-        port = ntohs(addr->sin_port);
+        remote_port = ntohs(addr->sin_port);
 
         /* port < 65536 */
-        ngx_snprintf(buf, 6, "%d", port);
         port_str.data = buf;
-        port_str.len = ngx_strlen(buf);
+        port_str.len = ngx_sprintf(buf, "%d", remote_port) - buf;
 
-        if (ajp_msg_append_uint8(msg, SC_A_REQ_ATTRIBUTE) ||
-            ajp_msg_append_string(msg, &temp_str)         ||
-            ajp_msg_append_string(msg, &port_str)) {
+        size += ajp_msg_size_bytes(msg, &ajp_template.remote_port)
+                + ajp_msg_size_string(msg, &port_str);
+    }
 
-            ngx_log_error(NGX_LOG_ERR, log, 0,
-                          "ajp_marshal_into_msgb: "
-                          "Error appending attribute %V=%V",
-                          &temp_str, &port_str);
-            return AJP_EOVERFLOW;
-        }
+    /*
+     * The static values of "ajp_param" are already encoded, only the
+     * variable ones are evaluated.
+     */
+    values = NULL;
 
-        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
-                       "ajp_marshal_into_msgb: attribute %V %V",
-                       &temp_str, &port_str);
+    if (alcf->params) {
+        if (sc_for_req_params_size(r, msg, alcf->params, &values, &size, NULL)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
     }
 
-    if (ajp_msg_append_uint8(msg, SC_A_ARE_DONE)) {
+    /* SC_A_ARE_DONE */
+    size += 1;
+
+    total = AJP_HEADER_LEN + size + msg->len;
+
+    /* the merge caps ajp_header_packet_buffer_size at AJP_MAX_BUFFER_SZ */
+
+    if (total > alcf->ajp_header_packet_buffer_size_conf) {
         ngx_log_error(NGX_LOG_ERR, log, 0,
                       "ajp_marshal_into_msgb: "
-                      "Error appending the message end");
+                      "the forward request packet of %uz bytes exceeds "
+                      "ajp_header_packet_buffer_size %uz",
+                      total, alcf->ajp_header_packet_buffer_size_conf);
         return AJP_EOVERFLOW;
     }
 
+    if (ajp_msg_create_buffer(r->pool, AJP_HEADER_LEN + size, msg) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (msg->gather) {
+        if (ajp_msg_gather_init(msg, r->pool) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    ajp_msg_reset(msg);
+
+    if (head != NULL) {
+        p = msg->buf->last;
+
+        /* always copied, the method slot is patched */
+        msg->buf->last = ngx_cpymem(p, head->data, head->len);
+
+        /* patch the method slot of the template */
+        p[1] = (u_char) method;
+
+    } else {
+        ajp_msg_put_uint8(msg, CMD_AJP13_FORWARD_REQUEST);
+        ajp_msg_put_uint8(msg, (u_char) method);
+        ajp_msg_put_string(msg, &r->http_protocol);
+    }
+
+    ajp_msg_put_string(msg, &uri);
+    ajp_msg_put_string(msg, remote_addr);
+    ajp_msg_put_string(msg, remote_host);
+    ajp_msg_put_string(msg, &r->headers_in.server);
+    ajp_msg_put_uint16(msg, port);
+    ajp_msg_put_uint8(msg, is_ssl);
+    ajp_msg_put_uint16(msg, (uint16_t) num_headers);
+
+    if (alcf->upstream.pass_request_headers) {
+
+        part = &r->headers_in.headers.part;
+        header = part->elts;
+
+        for (i = 0; /* void */; i++) {
+            if (i >= part->nelts) {
+                if (part->next == NULL) {
+                    break;
+                }
+
+                part = part->next;
+                header = part->elts;
+                i = 0;
+            }
+
+            if (!sc_for_req_header_passed(alcf, &header[i])) {
+                continue;
+            }
+
+            if ((sc = sc_for_req_header(&header[i])) != UNKNOWN_METHOD) {
+                ajp_msg_put_uint16(msg, (uint16_t) sc);
+
+            } else {
+                ajp_msg_put_string(msg, &header[i].key);
+            }
+
+            ajp_msg_put_string(msg, &header[i].value);
+
+            ngx_log_debug3(NGX_LOG_DEBUG_HTTP, log, 0,
+                           "ajp_marshal_into_msgb: Header[%d] [%V] = [%V]",
+                           i, &header[i].key, &header[i].value);
+        }
+    }
+
+    if (alcf->set_headers) {
+        sc_for_req_put_params(msg, alcf->set_headers, set_values, log);
+    }
+
+    if ((attrs & NGX_HTTP_AJP_ATTR_REMOTE_USER)
+        && r->headers_in.user.len != 0)
+    {
+        ajp_msg_put_uint8(msg, SC_A_REMOTE_USER);
+        ajp_msg_put_string(msg, &r->headers_in.user);
+    }
+
+    if (auth_type.len > 0) {
+        ajp_msg_put_uint8(msg, SC_A_AUTH_TYPE);
+        ajp_msg_put_string(msg, &auth_type);
+    }
+
+    if (r->args.len > 0) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "ajp_marshal_into_msgb: append_args=\"%V\"", &r->args);
+
+        ajp_msg_put_uint8(msg, SC_A_QUERY_STRING);
+        ajp_msg_put_string(msg, &r->args);
+    }
+
+    if (jvm_route != NULL) {
+        ajp_msg_put_uint8(msg, SC_A_JVM_ROUTE);
+        ajp_msg_put_string(msg, jvm_route);
+    }
+
+#if (NGX_HTTP_SSL)
+
+    if (ssl_segment != NULL) {
+        sc_for_req_ssl_segment(msg, ssl_segment, attrs, 1);
+    }
+#endif
+
+    if (attrs & NGX_HTTP_AJP_ATTR_REMOTE_PORT) {
+        ajp_msg_put_bytes(msg, &ajp_template.remote_port);
+        ajp_msg_put_string(msg, &port_str);
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "ajp_marshal_into_msgb: attribute %s %V",
+                       SC_A_REQ_REMOTE_PORT, &port_str);
+    }
+
+    if (alcf->params) {
+        sc_for_req_put_params(msg, alcf->params, values, log);
+    }
+
+    ajp_msg_put_uint8(msg, SC_A_ARE_DONE);
+
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
                    "ajp_marshal_into_msgb: Done, buff_size: %z",
                    ngx_buf_size(msg->buf));
@@ -705,7 +1485,6 @@ ajp_unmarshal_response(ajp_msg_t *msg,
     ngx_http_request_t *r, ngx_http_ajp_loc_conf_t *alcf)
 {
     int                             i;
-    u_char                          line[1024], *last;
     uint16_t                        status;
     uint16_t                        name;
     uint16_t                        num_headers;
@@ -738,13 +1517,12 @@ ajp_unmarshal_response(ajp_msg_t *msg,
     rc = ajp_msg_get_string(msg, &str);
     if (rc == NGX_OK) {
         if (str.len > 0) {
-            last = ngx_snprintf(line, 1024, "%d %V", status, &str);
-
-            str.data = line;
-            str.len = last - line;
-
-            u->headers_in.status_line.data = ngx_pstrdup(r->pool, &str);
-            u->headers_in.status_line.len = str.len;
+            if (get_res_status_line(status, &str, &u->headers_in.status_line,
+                                    r->pool)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
 
         } else {
             u->headers_in.status_line.data = NULL;
@@ -793,7 +1571,7 @@ ajp_unmarshal_response(ajp_msg_t *msg,
             ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
                            "http ajp known header: %08Xd", name);
 
-            rc = get_res_header_for_sc(name, h);
+            rc = get_res_header_for_sc(name, h, &hh);
             if (rc != NGX_OK) {
                 ngx_log_error(NGX_LOG_ERR, log, 0,
                               "ajp_unmarshal_response: No such sc (%08Xd)",
@@ -815,7 +1593,7 @@ ajp_unmarshal_response(ajp_msg_t *msg,
             ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
                     "http ajp unknown header: %V", &str);
 
-            rc = get_res_unknown_header_by_str(&str, h, r->pool);
+            rc = get_res_unknown_header_by_str(&str, h, &hh, umcf, r->pool);
             if (rc != NGX_OK) {
                 return rc;
             }
@@ -830,9 +1608,6 @@ ajp_unmarshal_response(ajp_msg_t *msg,
             return rc;
         }
 
-        hh = ngx_hash_find(&umcf->headers_in_hash, h->hash,
-                           h->lowcase_key, h->key.len);
-
         if (hh && hh->handler(r, h, hh->offset) != NGX_OK) {
             ngx_log_error(NGX_LOG_ERR, log, 0,
                           "ajp_unmarshal_response: hh->handler error: \"%V: %V\"",
@@ -25,10 +25,27 @@
 #define AJP_NULL_STRING_LENGTH (uint16_t)(-1)
 #define AJP_EOVERFLOW          1001
 
+/*
+ * In the gather mode, strings at least this long are referenced in place
+ * instead of being copied into the message buffer
+ */
+#define AJP_MSG_GATHER_MIN_LEN  256
+#define AJP_MSG_GATHER_MAX_REFS 16
+
 typedef struct ajp_msg {
-    ngx_buf_t  *buf;
-    size_t      len;
-    int         server_side;
+    ngx_buf_t    *buf;
+    /* the length of the referenced strings in the gather mode */
+    size_t        len;
+    int           server_side;
+
+    /* the gather mode, see ajp_msg_gather_init() */
+    unsigned      gather:1;
+    ngx_chain_t  *out;
+    ngx_chain_t **last_out;
+    ngx_chain_t  *free;
+    u_char       *seg;
+    ngx_uint_t    nrefs;
+    ngx_uint_t    max_refs;
 } ajp_msg_t;
 
 /*
@@ -259,6 +276,17 @@ ngx_int_t ajp_msg_reset(ajp_msg_t *msg);
  */
 ajp_msg_t * ajp_msg_reuse(ajp_msg_t *msg);
 
+/*
+ * Prepare the chain of an AJP Message in the gather mode, in which long
+ * strings are referenced by the chain msg->out instead of being copied.
+ * The references must have been counted by ajp_msg_size_string().
+ *
+ * @param msg       AJP Message with the buffer already created
+ * @param pool      pool to allocate the chain from
+ * @return          NGX_OK or error
+ */
+ngx_int_t ajp_msg_gather_init(ajp_msg_t *msg, ngx_pool_t *pool);
+
 /*
  * Mark the end of an AJP Message
  *
@@ -303,6 +331,71 @@ ngx_int_t ajp_msg_append_uint8(ajp_msg_t *msg, u_char value);
  */
 ngx_int_t ajp_msg_append_string(ajp_msg_t *msg, ngx_str_t *value);
 
+/*
+ * Add the pre-serialized bytes in AJP message
+ *
+ * @param msg       AJP Message to get value from
+ * @param value     Pointer to the serialized bytes
+ * @return          NGX_OK or error
+ */
+ngx_int_t ajp_msg_append_bytes(ajp_msg_t *msg, ngx_str_t *value);
+
+/*
+ * Get the room a string takes in the buffer of AJP Message, and count it
+ * as a reference in the gather mode
+ *
+ * @param msg       AJP Message being sized
+ * @param value     Pointer to string, NULL for the null string
+ * @return          the encoded length without the referenced bytes
+ */
+size_t ajp_msg_size_string(ajp_msg_t *msg, ngx_str_t *value);
+
+/*
+ * Add a string in AJP message without the bound check, the buffer must
+ * have been sized with ajp_msg_size_string()
+ *
+ * @param msg       AJP Message to get value from
+ * @param value     Pointer to string, NULL for the null string
+ */
+void ajp_msg_put_string(ajp_msg_t *msg, ngx_str_t *value);
+
+/*
+ * Get the room of the pre-serialized bytes in the buffer of AJP Message,
+ * and count them as a reference in the gather mode
+ *
+ * @param msg       AJP Message being sized
+ * @param value     Pointer to the serialized bytes
+ * @return          the length without the referenced bytes
+ */
+size_t ajp_msg_size_bytes(ajp_msg_t *msg, ngx_str_t *value);
+
+/*
+ * Add the pre-serialized bytes in AJP message without the bound check, the
+ * buffer must have been sized with ajp_msg_size_bytes()
+ *
+ * @param msg       AJP Message to get value from
+ * @param value     Pointer to the serialized bytes
+ */
+void ajp_msg_put_bytes(ajp_msg_t *msg, ngx_str_t *value);
+
+/*
+ * Add the values in AJP message without the bound check
+ */
+static ngx_inline void
+ajp_msg_put_uint8(ajp_msg_t *msg, u_char value)
+{
+    *msg->buf->last++ = value;
+}
+
+
+static ngx_inline void
+ajp_msg_put_uint16(ajp_msg_t *msg, uint16_t value)
+{
+    *msg->buf->last++ = (u_char)((value >> 8) & 0xFF);
+    *msg->buf->last++ = (u_char)(value & 0xFF);
+}
+
+
 /*
  * Get a 32bits unsigned value from AJP Message
  *
@@ -419,9 +512,48 @@ u_char * ajp_msg_dump(ngx_pool_t *pool, ajp_msg_t *msg, char *err);
 
 
 /*
- * Initialize the headers of request and reponse
+ * Initialize the headers of reponse
+ */
+void ajp_header_init(ngx_http_upstream_main_conf_t *umcf);
+
+/*
+ * Initialize the cache of the SSL attributes
+ *
+ * @return          NGX_OK or error
+ */
+ngx_int_t ajp_ssl_init(void);
+
+/*
+ * Serialize the constant segments of the FORWARD_REQUEST packet, once
+ *
+ * @return          NGX_OK or error
+ */
+ngx_int_t ajp_template_init(void);
+
+/*
+ * Serialize the code and the name of an "ajp_param" attribute
+ *
+ * @param pool      pool to allocate from
+ * @param param     the attribute, the key is set on return
+ * @param name      the name of the attribute
+ * @param value     the static value, or NULL if it is variable
+ * @return          NGX_OK or error
+ */
+ngx_int_t ajp_param_init(ngx_pool_t *pool, ngx_http_ajp_param_t *param,
+    ngx_str_t *name, ngx_str_t *value);
+
+/*
+ * Serialize the name of an "ajp_set_header" header, its code if it is
+ * a known request header
+ *
+ * @param pool      pool to allocate from
+ * @param param     the header with the lowercase name, the key is set
+ * @param name      the name of the header
+ * @param value     the static value, or NULL if it is variable
+ * @return          NGX_OK or error
  */
-void ajp_header_init(void);
+ngx_int_t ajp_set_header_init(ngx_pool_t *pool, ngx_http_ajp_param_t *param,
+    ngx_str_t *name, ngx_str_t *value);
 
 /*
  * Fill the request packet into AJP message
@@ -446,8 +578,8 @@ ngx_int_t ajp_unmarshal_response(ajp_msg_t *msg,
         ngx_http_request_t *r, ngx_http_ajp_loc_conf_t *alcf);
 
 /*
- * Handle the CPING/CPONG messages
- * TODO: health check
+ * Handle the CPING/CPONG messages, CPING checks the idle connections of
+ * "ajp_ping"
  */
 
 /*
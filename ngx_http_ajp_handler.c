@@ -17,21 +17,45 @@ static ngx_int_t ngx_http_ajp_process_header(ngx_http_request_t *r);
 static ngx_int_t ngx_http_ajp_input_filter_init(void *data);
 static ngx_int_t ngx_http_ajp_input_filter(ngx_event_pipe_t *p,
     ngx_buf_t *buf);
+static void ngx_http_ajp_pipe_flush(ngx_event_pipe_t *p,
+    ngx_http_ajp_ctx_t *a, ngx_buf_t *b);
+static ngx_int_t ngx_http_ajp_non_buffered_filter(void *data, ssize_t bytes);
 static void ngx_http_ajp_abort_request(ngx_http_request_t *r);
 static void ngx_http_ajp_finalize_request(ngx_http_request_t *r,
     ngx_int_t rc);
 
+static ngx_int_t ngx_http_ajp_init_request_body(ngx_http_request_t *r,
+    ngx_http_ajp_ctx_t *a, ngx_http_ajp_loc_conf_t *alcf);
+static size_t ngx_http_ajp_body_packet_size(ngx_http_ajp_ctx_t *a,
+    ngx_http_ajp_loc_conf_t *alcf);
 static ngx_int_t ngx_http_upstream_send_request_body(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
 static ngx_chain_t *ajp_data_msg_send_body(ngx_http_request_t *r, size_t max_size,
     ngx_chain_t **body);
+static ngx_chain_t *ajp_data_msg_get_header(ngx_http_request_t *r,
+    ngx_http_ajp_ctx_t *a, ajp_msg_t *msg, size_t size);
+static void ajp_data_msg_update_chains(ngx_http_ajp_ctx_t *a,
+    ngx_chain_t *out);
 static void ngx_http_upstream_send_request_body_handler(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
 static void ngx_http_upstream_dummy_handler(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
+#if (nginx_version >= 1007011)
+static ngx_int_t ngx_http_ajp_body_output_filter(void *data, ngx_chain_t *in);
+#endif
+
+
+/*
+ * The buffers of the packets built by the module, the data packet headers
+ * own their memory, unlike the body buffers. It differs from the tag of
+ * u->output, which would take them as its own free buffers.
+ */
+#define ngx_http_ajp_packet_tag  (ngx_buf_tag_t) &ajp_data_msg_get_header
 
-static ngx_int_t ngx_http_ajp_move_buffer(ngx_http_request_t *r, ngx_buf_t *buf,
-    u_char *pos, u_char *last);
+
+static ngx_int_t ngx_http_ajp_get_packet(ngx_http_request_t *r,
+    ngx_http_ajp_ctx_t *a, ngx_buf_t *buf);
+static void ngx_http_ajp_reset_buffer(ngx_http_request_t *r, ngx_buf_t *buf);
 static ngx_int_t ngx_http_ajp_process_packet_header(ngx_http_request_t *r,
     ngx_http_ajp_ctx_t *a, ngx_buf_t *buf);
 static void ngx_http_ajp_end_response(ngx_http_request_t *r, int reuse);
@@ -92,7 +116,7 @@ ngx_http_ajp_handler(ngx_http_request_t *r)
     u->abort_request = ngx_http_ajp_abort_request;
     u->finalize_request = ngx_http_ajp_finalize_request;
 
-    u->buffering = 1;
+    u->buffering = alcf->upstream.buffering;
 
     u->pipe = ngx_pcalloc(r->pool, sizeof(ngx_event_pipe_t));
     if (u->pipe == NULL) {
@@ -102,6 +126,20 @@ ngx_http_ajp_handler(ngx_http_request_t *r)
     u->pipe->input_filter = ngx_http_ajp_input_filter;
     u->pipe->input_ctx = r;
     u->input_filter_init = ngx_http_ajp_input_filter_init;
+    u->input_filter = ngx_http_ajp_non_buffered_filter;
+    u->input_filter_ctx = r;
+
+#if (nginx_version >= 1007011)
+
+    /* the body of unknown length is still buffered to get its length */
+    if (!alcf->upstream.request_buffering
+        && alcf->upstream.pass_request_body
+        && r->headers_in.content_length_n > 0)
+    {
+        r->request_body_no_buffering = 1;
+    }
+
+#endif
 
     rc = ngx_http_read_client_request_body(r, ngx_http_upstream_init);
 
@@ -207,44 +245,72 @@ ngx_http_ajp_create_request(ngx_http_request_t *r)
 
     msg = ajp_msg_reuse(&a->msg);
 
-    if (NGX_OK != ajp_msg_create_buffer(r->pool,
-                alcf->ajp_header_packet_buffer_size_conf, msg)) {
+    /* the buffer is allocated by the marshaller with the exact size */
+    msg->gather = alcf->header_zero_copy ? 1 : 0;
+
+    if (NGX_OK != ajp_marshal_into_msgb(msg, r, alcf)) {
         return NGX_ERROR;
     }
 
-    if (NGX_OK != ajp_marshal_into_msgb(msg, r, alcf)) {
+    if (NGX_OK != ajp_msg_end(msg)) {
         return NGX_ERROR;
     }
 
-    ajp_msg_end(msg);
+    if (msg->gather) {
+        /* the packet is sent with the chain of its segments */
+        for (cl = msg->out; cl->next; cl = cl->next) { /* void */ }
 
-    cl = ngx_alloc_chain_link(r->pool);
-    if (cl == NULL) {
-        return NGX_ERROR;
+    } else {
+        cl = ngx_alloc_chain_link(r->pool);
+        if (cl == NULL) {
+            return NGX_ERROR;
+        }
+
+        cl->buf = msg->buf;
     }
 
-    cl->buf = msg->buf;
     cl->buf->flush = 1;
 
     a->state = ngx_http_ajp_st_forward_request_sent;
 
-    if (alcf->upstream.pass_request_body) {
-        a->body = r->upstream->request_bufs;
-        r->upstream->request_bufs = cl;
+#if (nginx_version >= 1007011)
 
-        cl->next = ajp_data_msg_send_body(r,
-                alcf->max_ajp_data_packet_size_conf, &a->body);
+    if (r->request_body_no_buffering) {
+        ngx_chain_t  *ln;
 
-        if (a->body) {
-            a->state = ngx_http_ajp_st_request_body_data_sending;
-        }
-        else {
-            a->state = ngx_http_ajp_st_request_send_all_done;
+        /*
+         * The client body is appended by the upstream as it is read, the
+         * output filter frames it into the data packets. The first one is
+         * sent without a GET_BODY_CHUNK.
+         */
+        for (ln = msg->gather ? msg->out : cl; ln; ln = ln->next) {
+            ln->buf->tag = ngx_http_ajp_packet_tag;
         }
 
+        a->body = NULL;
+        a->state = ngx_http_ajp_st_request_body_data_sending;
+
+        r->upstream->request_bufs = msg->gather ? msg->out : cl;
+        cl->next = NULL;
+
+        r->upstream->output.output_filter = ngx_http_ajp_body_output_filter;
+        r->upstream->output.filter_ctx = r;
+
+        return NGX_OK;
+    }
+
+#endif
+
+    if (alcf->upstream.pass_request_body) {
+        a->body = r->upstream->request_bufs;
+        a->request = cl;
+        r->upstream->request_bufs = msg->gather ? msg->out : cl;
+
+        return ngx_http_ajp_init_request_body(r, a, alcf);
+
     } else {
         a->state = ngx_http_ajp_st_request_send_all_done;
-        r->upstream->request_bufs = cl;
+        r->upstream->request_bufs = msg->gather ? msg->out : cl;
         cl->next = NULL;
     }
 
@@ -255,6 +321,8 @@ ngx_http_ajp_create_request(ngx_http_request_t *r)
 static ngx_int_t
 ngx_http_ajp_reinit_request(ngx_http_request_t *r)
 {
+    off_t                     file_pos;
+    ngx_chain_t              *cl;
     ngx_http_ajp_ctx_t       *a;
     ngx_http_ajp_loc_conf_t  *alcf;
 
@@ -269,37 +337,185 @@ ngx_http_ajp_reinit_request(ngx_http_request_t *r)
     a->pstate = ngx_http_ajp_pst_init_state;
     a->length = 0;
     a->extra_zero_byte = 0;
+    a->flush = 0;
 
     ajp_msg_reuse(&a->msg);
+    a->hold_size = 0;
 
     a->body = NULL;
 
+    /* the busy buffers may still be referenced by the old connection */
+    a->busy = NULL;
+
+    a->body_chunk_size = 0;
+    a->body_requests = 0;
+    a->body_last = 0;
+    a->body_done = 0;
+
+    if (a->request == NULL || r->request_body == NULL
+#if (nginx_version >= 1007011)
+        || r->request_body_no_buffering
+#endif
+       )
+    {
+        return NGX_OK;
+    }
+
+    /*
+     * The packets sent after the request_bufs are lost with the old
+     * connection, so the client body is framed again from its start.
+     */
+
+    file_pos = 0;
+
+    for (cl = r->request_body->bufs; cl; cl = cl->next) {
+        cl->buf->pos = cl->buf->start;
+
+        /* there is at most one file */
+        if (cl->buf->in_file) {
+            cl->buf->file_pos = file_pos;
+            file_pos = cl->buf->file_last;
+        }
+    }
+
+    a->body = r->request_body->bufs;
+
+    return ngx_http_ajp_init_request_body(r, a, alcf);
+}
+
+
+/*
+ * The first data packet is sent without a GET_BODY_CHUNK, and the
+ * prefetched ones right after it, all with the forward request.
+ */
+static ngx_int_t
+ngx_http_ajp_init_request_body(ngx_http_request_t *r, ngx_http_ajp_ctx_t *a,
+    ngx_http_ajp_loc_conf_t *alcf)
+{
+    ngx_chain_t  *cl;
+
+    cl = a->request;
+    cl->next = NULL;
+
+    a->body_packets = 0;
+
+    while (a->body && a->body_packets <= alcf->body_prefetch) {
+        cl->next = ajp_data_msg_send_body(r,
+                ngx_http_ajp_body_packet_size(a, alcf), &a->body);
+        if (cl->next == NULL) {
+            return NGX_ERROR;
+        }
+
+        for (cl = cl->next; cl->next; cl = cl->next) { /* void */ }
+
+        a->body_packets++;
+    }
+
+    if (a->body) {
+        a->state = ngx_http_ajp_st_request_body_data_sending;
+    }
+    else {
+        a->state = ngx_http_ajp_st_request_send_all_done;
+    }
+
     return NGX_OK;
 }
 
 
-static ngx_list_t *
-ngx_list_reinit(ngx_list_t *list)
+/*
+ * Set a->packet to the next whole packet of the response. A packet split
+ * across the reads is assembled in a->hold, up to the largest AJP packet,
+ * and u->buffer is emptied to read the rest of it. The data packets are
+ * left to the input filter, only their type is needed here.
+ */
+static ngx_int_t
+ngx_http_ajp_get_packet(ngx_http_request_t *r, ngx_http_ajp_ctx_t *a,
+    ngx_buf_t *buf)
 {
-    ngx_list_part_t  *head;
+    u_char  *p;
+    size_t   size, len, n;
+
+    if (a->hold_size) {
+        n = ngx_min(a->hold_size - (size_t) (a->hold->last - a->hold->pos),
+                    (size_t) (buf->last - buf->pos));
+
+        a->hold->last = ngx_cpymem(a->hold->last, buf->pos, n);
+        buf->pos += n;
+
+        if ((size_t) (a->hold->last - a->hold->pos) < a->hold_size) {
+            ngx_http_ajp_reset_buffer(r, buf);
+            return NGX_AGAIN;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "ajp packet assembled, size: %uz", a->hold_size);
+
+        a->hold_size = 0;
+        a->packet = *a->hold;
+
+        return NGX_OK;
+    }
 
-    head = &list->part;
+    p = buf->pos;
+    size = buf->last - p;
 
-    if (head->nelts > 0) {
-        list->last = head;
+    if (size < AJP_HEADER_LEN + 1) {
+        /* the few bytes left are moved to the start of the buffer */
+        ngx_http_ajp_reset_buffer(r, buf);
+        buf->last = ngx_movemem(buf->pos, p, size);
+
+        return NGX_AGAIN;
+    }
+
+    len = AJP_HEADER_LEN + (p[2] << 8) + p[3];
+
+    if (size >= len || p[4] == CMD_AJP13_SEND_BODY_CHUNK) {
+        n = ngx_min(size, len);
+
+        a->packet.start = p;
+        a->packet.pos = p;
+        a->packet.last = p + n;
+        buf->pos += n;
+
+        return NGX_OK;
+    }
 
-        head->nelts = 0;
-        head->next = NULL;
+    if (a->hold == NULL || (size_t) (a->hold->end - a->hold->start) < len) {
+        a->hold = ngx_create_temp_buf(r->pool, len);
+        if (a->hold == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    a->hold->pos = a->hold->start;
+    a->hold->last = ngx_cpymem(a->hold->start, p, size);
+    a->hold_size = len;
+
+    ngx_http_ajp_reset_buffer(r, buf);
+
+    return NGX_AGAIN;
+}
+
+
+static void
+ngx_http_ajp_reset_buffer(ngx_http_request_t *r, ngx_buf_t *buf)
+{
+    buf->pos = buf->start;
+
+#if (NGX_HTTP_CACHE)
+    if (r->cache) {
+        buf->pos += r->cache->header_start;
     }
+#endif
 
-    return list;
+    buf->last = buf->pos;
 }
 
 
 static ngx_int_t
 ngx_http_ajp_process_header(ngx_http_request_t *r)
 {
-    u_char                   *pos, *last, type, reuse;
+    u_char                   *pos, type, reuse;
     uint16_t                  length;
     ngx_int_t                 rc;
     ngx_buf_t                *buf;
@@ -319,24 +535,25 @@ ngx_http_ajp_process_header(ngx_http_request_t *r)
                   "ngx_http_ajp_process_header: state(%d)", a->state);
 
     u = r->upstream;
+    buf = &u->buffer;
 
-    msg = ajp_msg_reuse(&a->msg);
-    buf = msg->buf = &u->buffer;
-
-    while (buf->pos < buf->last) {
+    for ( ;; ) {
 
         ngx_log_error(NGX_LOG_DEBUG, r->connection->log, 0,
                       "ngx_http_ajp_process_header: parse response, "
                       "pos:%p, last:%p", buf->pos, buf->last);
 
-        /* save the position for returning NGX_AGAIN */
-        pos = buf->pos;
-        last = buf->last;
-
-        if (ngx_buf_size(msg->buf) < AJP_HEADER_LEN + 1) {
-            return ngx_http_ajp_move_buffer(r, buf, pos, last);
+        rc = ngx_http_ajp_get_packet(r, a, buf);
+        if (rc != NGX_OK) {
+            return rc;
         }
 
+        msg = ajp_msg_reuse(&a->msg);
+        msg->buf = &a->packet;
+
+        /* the start of a data packet for the input filter */
+        pos = a->packet.pos;
+
         rc = ajp_msg_parse_begin(msg);
         if (rc != NGX_OK) {
             ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
@@ -355,10 +572,31 @@ ngx_http_ajp_process_header(ngx_http_request_t *r)
             case CMD_AJP13_GET_BODY_CHUNK:
 
                 rc = ajp_msg_get_uint16(msg, &length);
-                if (rc == AJP_EOVERFLOW) {
-                    return ngx_http_ajp_move_buffer(r, buf, pos, last);
+                if (rc != NGX_OK) {
+                    return NGX_ERROR;
+                }
+                /*
+                 * The length is the size of the container's read buffer,
+                 * the next data packet fills it exactly.
+                 */
+                a->body_chunk_size = ngx_min((size_t) length,
+                                             AJP13_MAX_SEND_BODY_SZ);
+                a->body_requests++;
+
+#if (nginx_version >= 1007011)
+
+                if (r->request_body_no_buffering && !a->body_done) {
+                    /*
+                     * The upstream still sends the body, its write handler
+                     * answers with the client data read so far.
+                     */
+                    ngx_post_event(u->peer.connection->write,
+                                   &ngx_posted_events);
+                    break;
                 }
 
+#endif
+
                 rc = ngx_http_upstream_send_request_body(r, u);
                 if (rc != NGX_OK) {
                     return rc;
@@ -370,26 +608,20 @@ ngx_http_ajp_process_header(ngx_http_request_t *r)
 
                 rc = ajp_unmarshal_response(msg, r, alcf);
 
+                /* the headers may point to the assembled packet */
+                a->hold = NULL;
+
                 if (rc == NGX_OK) {
                     a->state = ngx_http_ajp_st_response_parse_headers_done;
                     return NGX_OK;
 
                 } else if (rc == AJP_EOVERFLOW) {
-                    a->state = ngx_http_ajp_st_response_recv_headers;
-
-                    /* reinit the headers_int list, the memory may be stale */
-                    ngx_list_reinit(&u->headers_in.headers);
-
-                    /* It's an uncomplete AJP packet, move back to the header
-                     * of packet, and parse the header again in next call
-                     */
-                    return ngx_http_ajp_move_buffer(r, buf, pos, last);
-
-                } else {
-                    return  NGX_ERROR;
+                    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                                  "ngx_http_ajp_process_header: "
+                                  "truncated SEND_HEADERS packet");
                 }
 
-                break;
+                return NGX_ERROR;
 
             case CMD_AJP13_SEND_BODY_CHUNK:
 
@@ -402,8 +634,8 @@ ngx_http_ajp_process_header(ngx_http_request_t *r)
             case CMD_AJP13_END_RESPONSE:
 
                 rc = ajp_msg_get_uint8(msg, &reuse);
-                if (rc == AJP_EOVERFLOW) {
-                    return ngx_http_ajp_move_buffer(r, buf, pos, last);
+                if (rc != NGX_OK) {
+                    return NGX_ERROR;
                 }
 
                 ngx_http_ajp_end_response(r, reuse);
@@ -421,8 +653,6 @@ ngx_http_ajp_process_header(ngx_http_request_t *r)
                 return  NGX_ERROR;
         }
     }
-
-    return NGX_AGAIN;
 }
 
 
@@ -431,46 +661,33 @@ ngx_http_ajp_input_filter_init(void *data)
 {
     ngx_http_request_t  *r = data;
 
+    ngx_http_ajp_ctx_t  *a;
+
+    a = ngx_http_get_module_ctx(r, ngx_http_ajp_module);
+
     r->upstream->pipe->length = (off_t) AJP_HEADER_LEN;
 
+    /* the response without buffering ends with the END_RESPONSE packet */
+    r->upstream->length = (a->state == ngx_http_ajp_st_response_end) ? 0 : -1;
+
     return NGX_OK;
 }
 
 
-static ngx_int_t
-ngx_http_ajp_move_buffer(ngx_http_request_t *r, ngx_buf_t *buf,
-    u_char *pos, u_char *last)
+/*
+ * The data packets fill the read buffer announced by the last GET_BODY_CHUNK,
+ * the prefetched ones as well. The configured size is only used before the
+ * first one.
+ */
+static size_t
+ngx_http_ajp_body_packet_size(ngx_http_ajp_ctx_t *a,
+    ngx_http_ajp_loc_conf_t *alcf)
 {
-    /* Move the end part data to the head of buffer, reuse the buffer. */
-    ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
-                  "ngx_http_ajp_process_header: move buffer for the ajp "
-                  "packet.\n");
-
-    /*
-     * The first buffer, there should have enough buffer room.
-     */
-    if (buf->last == buf->end) {
-        buf->pos = buf->start;
-        buf->last = buf->start + (last - pos);
-
-        if (buf->last > pos ) {
-            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                          "ngx_http_ajp_process_header: too small buffer for "
-                          "the ajp packet.\n");
-
-            return NGX_ERROR;
-        }
-
-        ngx_memcpy(buf->pos, pos, last - pos);
-
-    } else {
-        /*
-         * Back to the orginal postion.
-         */
-        buf->pos = pos;
+    if (a->body_chunk_size) {
+        return a->body_chunk_size + AJP_HEADER_SZ;
     }
 
-    return NGX_AGAIN;
+    return alcf->max_ajp_data_packet_size_conf;
 }
 
 
@@ -479,8 +696,8 @@ ngx_http_upstream_send_request_body(ngx_http_request_t *r,
     ngx_http_upstream_t *u)
 {
     ngx_int_t                  rc;
-    ngx_chain_t               *cl;
-    ajp_msg_t                 *msg, local_msg;
+    ngx_chain_t               *cl, *out, **ll;
+    ajp_msg_t                  local_msg;
     ngx_connection_t          *c;
     ngx_http_ajp_ctx_t        *a;
     ngx_http_ajp_loc_conf_t   *alcf;
@@ -496,33 +713,61 @@ ngx_http_upstream_send_request_body(ngx_http_request_t *r,
                       a->state);
     }
 
-    cl = ajp_data_msg_send_body(r, alcf->max_ajp_data_packet_size_conf,
-                                &a->body);
+    out = NULL;
+    ll = &out;
 
-    if (u->output.in == NULL && u->output.busy == NULL) {
-        if (cl == NULL) {
+    /*
+     * A GET_BODY_CHUNK is answered only if no prefetched packet was sent
+     * for it, so the retries of the write handler just flush the output.
+     */
+    if (a->body_packets <= a->body_requests) {
+
+        if (a->body) {
+            cl = ajp_data_msg_send_body(r,
+                                        ngx_http_ajp_body_packet_size(a, alcf),
+                                        &a->body);
+            if (cl == NULL) {
+                return NGX_ERROR;
+            }
+
+        } else {
             /* If there is no more data in the body (i.e. the servlet
              * container is trying to read past the end of the body),
              * the server will send back an "empty" packet, which is
              * a body packet with a payload length of 0.
              * (0x12,0x34,0x00,0x00)
              */
-            msg = ajp_msg_reuse(&local_msg);
-
-            if (ajp_alloc_data_msg(r->pool, msg) != NGX_OK) {
+            cl = ajp_data_msg_get_header(r, a, &local_msg, AJP_HEADER_SZ + 1);
+            if (cl == NULL) {
                 return NGX_ERROR;
             }
 
-            ajp_data_msg_end(msg, 0);
+            ajp_data_msg_end(&local_msg, 0);
+        }
 
-            cl = ngx_alloc_chain_link(r->pool);
-            if (cl == NULL) {
-                return NGX_ERROR;
-            }
+        *ll = cl;
+        for ( /* void */ ; cl->next; cl = cl->next) { /* void */ }
+        ll = &cl->next;
 
-            cl->buf = msg->buf;
-            cl->next = NULL;
+        a->body_packets++;
+    }
+
+    /* keep the "ajp_body_prefetch" packets ahead of the requests */
+
+    while (a->body
+           && a->body_packets <= a->body_requests + alcf->body_prefetch)
+    {
+        cl = ajp_data_msg_send_body(r, ngx_http_ajp_body_packet_size(a, alcf),
+                                    &a->body);
+        if (cl == NULL) {
+            return NGX_ERROR;
         }
+
+        *ll = cl;
+        for ( /* void */ ; cl->next; cl = cl->next) { /* void */ }
+        ll = &cl->next;
+
+        a->body_packets++;
     }
 
     if (a->body) {
@@ -534,12 +779,14 @@ ngx_http_upstream_send_request_body(ngx_http_request_t *r,
 
     c->log->action = "sending request body again to upstream";
 
-    rc = ngx_output_chain(&u->output, cl);
+    rc = ngx_output_chain(&u->output, out);
 
     if (rc == NGX_ERROR) {
         return NGX_ERROR;
     }
 
+    ajp_data_msg_update_chains(a, out);
+
     if (c->write->timer_set) {
         ngx_del_timer(c->write);
     }
@@ -586,7 +833,7 @@ ajp_data_msg_send_body(ngx_http_request_t *r, size_t max_size,
 {
     size_t               size;
     ngx_buf_t           *b_in, *b_out;
-    ajp_msg_t           *msg;
+    ajp_msg_t            msg;
     ngx_chain_t         *out, *cl, *in;
     ngx_http_ajp_ctx_t  *a;
 
@@ -599,19 +846,13 @@ ajp_data_msg_send_body(ngx_http_request_t *r, size_t max_size,
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "ajp_data_msg_send_body");
 
-    msg = ajp_msg_reuse(&a->msg);
+    /* a->msg may still hold the response packet with the GET_BODY_CHUNK */
 
-    if (ajp_alloc_data_msg(r->pool, msg) != NGX_OK) {
-        return NULL;
-    }
-
-    out = cl = ngx_alloc_chain_link(r->pool);
+    out = cl = ajp_data_msg_get_header(r, a, &msg, AJP_HEADER_SZ + 1);
     if (cl == NULL) {
         return NULL;
     }
 
-    cl->buf = msg->buf;
-
     max_size -= AJP_HEADER_SZ;
     size = 0;
     in = *body;
@@ -620,13 +861,31 @@ ajp_data_msg_send_body(ngx_http_request_t *r, size_t max_size,
     while (in) {
         b_in = in->buf;
 
-        b_out = ngx_alloc_buf(r->pool);
-        if (b_out == NULL) {
+        cl->next = ngx_chain_get_free_buf(r->pool, &a->free_bufs);
+        if (cl->next == NULL) {
             return NULL;
         }
+
+        cl = cl->next;
+
+        b_out = cl->buf;
         ngx_memcpy(b_out, b_in, sizeof(ngx_buf_t));
 
         if (b_in->in_file) {
+
+            /*
+             * A pure file range, which the output chain passes as it is
+             * to sendfile(), between the packet headers sent by writev().
+             * The memory copy of the body, if any, is not a part of it,
+             * otherwise it would be sent instead of the range.
+             */
+            b_out->temporary = 0;
+            b_out->memory = 0;
+            b_out->mmap = 0;
+            b_out->start = NULL;
+            b_out->pos = NULL;
+            b_out->last = NULL;
+
             if ((size_t)(b_in->file_last - b_in->file_pos) <=
                 (max_size - size)) {
 
@@ -646,6 +905,9 @@ ajp_data_msg_send_body(ngx_http_request_t *r, size_t max_size,
             }
 
         } else {
+            b_out->in_file = 0;
+            b_out->temp_file = 0;
+
             if ((size_t)(b_in->last - b_in->pos) <= (max_size - size)) {
                 b_out->pos = b_in->pos;
                 b_out->last = b_in->pos = b_in->last;
@@ -659,16 +921,11 @@ ajp_data_msg_send_body(ngx_http_request_t *r, size_t max_size,
 
                 size += b_out->last - b_out->pos;
             }
-        }
 
-        cl->next = ngx_alloc_chain_link(r->pool);
-        if (cl->next == NULL) {
-            return NULL;
+            /* the upstream resets the request_bufs to their start */
+            b_out->start = b_out->pos;
         }
 
-        cl = cl->next;
-        cl->buf = b_out;
-
         if (size >= max_size) {
             break;
 
@@ -680,12 +937,241 @@ ajp_data_msg_send_body(ngx_http_request_t *r, size_t max_size,
     *body = in;
     cl->next = NULL;
 
-    ajp_data_msg_end(msg, size);
+    ajp_data_msg_end(&msg, size);
 
     return out;
 }
 
 
+static ngx_chain_t *
+ajp_data_msg_get_header(ngx_http_request_t *r, ngx_http_ajp_ctx_t *a,
+    ajp_msg_t *msg, size_t size)
+{
+    ngx_buf_t    *b;
+    ngx_chain_t  *cl;
+
+    cl = ngx_chain_get_free_buf(r->pool, &a->free_headers);
+    if (cl == NULL) {
+        return NULL;
+    }
+
+    b = cl->buf;
+
+    if (b->start == NULL || (size_t) (b->end - b->start) < size) {
+        b->start = ngx_pnalloc(r->pool, size);
+        if (b->start == NULL) {
+            return NULL;
+        }
+
+        b->end = b->start + size;
+        b->temporary = 1;
+        b->tag = ngx_http_ajp_packet_tag;
+    }
+
+    b->pos = b->last = b->start;
+
+    ajp_msg_reuse(msg);
+    msg->buf = b;
+
+    return cl;
+}
+
+
+/*
+ * The data packets are built from the recycled links and buffers, so a
+ * large request body only takes the memory of the packets in flight.
+ */
+static void
+ajp_data_msg_update_chains(ngx_http_ajp_ctx_t *a, ngx_chain_t *out)
+{
+    ngx_chain_t  *cl, **ll;
+
+    if (out) {
+        for (ll = &a->busy; *ll; ll = &(*ll)->next) { /* void */ }
+        *ll = out;
+    }
+
+    while (a->busy) {
+        cl = a->busy;
+
+        if (ngx_buf_size(cl->buf) != 0) {
+            break;
+        }
+
+        a->busy = cl->next;
+
+        if (cl->buf->tag == ngx_http_ajp_packet_tag) {
+            cl->next = a->free_headers;
+            a->free_headers = cl;
+
+        } else {
+            cl->next = a->free_bufs;
+            a->free_bufs = cl;
+        }
+    }
+}
+
+
+#if (nginx_version >= 1007011)
+
+/*
+ * The output filter of the unbuffered request body. The packets built by
+ * the module pass as they are, the client body is framed into the data
+ * packets, but only one for each GET_BODY_CHUNK and the prefetched ones, the
+ * rest waits in a->body and holds the client buffers, which stops reading
+ * from the client.
+ */
+static ngx_int_t
+ngx_http_ajp_body_output_filter(void *data, ngx_chain_t *in)
+{
+    ngx_http_request_t *r = data;
+
+    size_t                    size, n;
+    ngx_int_t                 rc;
+    ngx_buf_t                *b;
+    ajp_msg_t                 msg;
+    ngx_chain_t              *cl, *ln, *out, **ll, *pass, **lp;
+    ngx_http_ajp_ctx_t       *a;
+    ngx_http_upstream_t      *u;
+    ngx_http_ajp_loc_conf_t  *alcf;
+
+    a = ngx_http_get_module_ctx(r, ngx_http_ajp_module);
+    alcf = ngx_http_get_module_loc_conf(r, ngx_http_ajp_module);
+
+    u = r->upstream;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "ajp body output filter, in: %p, packets: %ui, "
+                   "requests: %ui", in, a->body_packets, a->body_requests);
+
+    pass = NULL;
+    lp = &pass;
+
+    for (ll = &a->body; *ll; ll = &(*ll)->next) { /* void */ }
+
+    for ( /* void */ ; in; in = in->next) {
+        b = in->buf;
+
+        if (b->last_buf) {
+            a->body_last = 1;
+        }
+
+        if (b->tag != ngx_http_ajp_packet_tag && ngx_buf_size(b) == 0) {
+            continue;
+        }
+
+        cl = ngx_alloc_chain_link(r->pool);
+        if (cl == NULL) {
+            return NGX_ERROR;
+        }
+
+        cl->buf = b;
+        cl->next = NULL;
+
+        if (b->tag == ngx_http_ajp_packet_tag) {
+            *lp = cl;
+            lp = &cl->next;
+
+        } else {
+            *ll = cl;
+            ll = &cl->next;
+        }
+    }
+
+    if (pass) {
+        rc = ngx_chain_writer(&u->writer, pass);
+
+        while (pass) {
+            ln = pass;
+            pass = pass->next;
+            ngx_free_chain(r->pool, ln);
+        }
+
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+    }
+
+    out = NULL;
+    ll = &out;
+
+    while (a->body_packets <= a->body_requests + alcf->body_prefetch) {
+
+        size = 0;
+
+        for (cl = a->body; cl; cl = cl->next) {
+            size += ngx_buf_size(cl->buf);
+        }
+
+        /* an empty packet if the container reads past the end */
+
+        if (size == 0
+            && (!a->body_last || a->body_packets > a->body_requests))
+        {
+            break;
+        }
+
+        size = ngx_min(size,
+                       ngx_http_ajp_body_packet_size(a, alcf) - AJP_HEADER_SZ);
+
+        cl = ajp_data_msg_get_header(r, a, &msg, AJP_HEADER_SZ + size);
+        if (cl == NULL) {
+            return NGX_ERROR;
+        }
+
+        ajp_data_msg_end(&msg, size);
+
+        b = cl->buf;
+
+        while (size) {
+            n = ngx_min(size, (size_t) (a->body->buf->last
+                                        - a->body->buf->pos));
+
+            b->last = ngx_cpymem(b->last, a->body->buf->pos, n);
+            a->body->buf->pos += n;
+            size -= n;
+
+            if (a->body->buf->pos == a->body->buf->last) {
+                ln = a->body;
+                a->body = ln->next;
+                ngx_free_chain(r->pool, ln);
+            }
+        }
+
+        cl->buf->flush = 1;
+
+        *ll = cl;
+        ll = &cl->next;
+
+        a->body_packets++;
+    }
+
+    rc = ngx_chain_writer(&u->writer, out);
+
+    ajp_data_msg_update_chains(a, out);
+
+    if (rc == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if (a->body) {
+        return NGX_AGAIN;
+    }
+
+    if (a->body_last) {
+        a->state = ngx_http_ajp_st_request_send_all_done;
+
+        if (rc == NGX_OK && !r->reading_body) {
+            a->body_done = 1;
+        }
+    }
+
+    return rc;
+}
+
+#endif
+
+
 static void
 ngx_http_upstream_send_request_body_handler(ngx_http_request_t *r,
     ngx_http_upstream_t *u)
@@ -714,6 +1200,7 @@ ngx_http_upstream_dummy_handler(ngx_http_request_t *r,
 static ngx_int_t
 ngx_http_ajp_input_filter(ngx_event_pipe_t *p, ngx_buf_t *buf)
 {
+    size_t                    n;
     ngx_int_t                 rc;
     ngx_buf_t                *b, **prev;
     ngx_chain_t              *cl;
@@ -754,6 +1241,25 @@ ngx_http_ajp_input_filter(ngx_event_pipe_t *p, ngx_buf_t *buf)
 
             rc = ngx_http_ajp_process_packet_header(r, a, buf);
 
+            if (rc == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+
+            /* Get a zero length packet, the servlet flushed its response */
+            if (rc == NGX_OK && a->length == 0) {
+
+                ngx_http_ajp_pipe_flush(p, a, b);
+
+                if (a->extra_zero_byte && (buf->pos < buf->last)
+                    && (*(buf->pos) == 0x00))
+                {
+                    buf->pos++;
+                    a->extra_zero_byte = 0;
+                }
+
+                continue;
+            }
+
             if (buf->pos == buf->last) {
                 break;
             }
@@ -765,30 +1271,34 @@ ngx_http_ajp_input_filter(ngx_event_pipe_t *p, ngx_buf_t *buf)
             if (rc == NGX_DONE) {
                 break;
             }
+        }
 
-            if (rc == NGX_ERROR) {
-                return NGX_ERROR;
-            }
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, p->log, 0,
+                       "input filter packet, length:%z, buffer_size:%z",
+                       a->length, ngx_buf_size(buf));
 
-        }
+        if (b && alcf->coalesce_body_chunks) {
 
-        /* Get a zero length packet */
-        if (a->length == 0) {
+            /*
+             * Slide the payload over the stripped packet headers, right
+             * after the previous one, all the payloads of the read buffer
+             * are then in a single buffer.
+             */
 
-            if (a->extra_zero_byte && (buf->pos < buf->last)
-                && (*(buf->pos) == 0x00))
-            {
-                buf->pos++;
-                a->extra_zero_byte = 0;
+            n = ngx_min(a->length, (size_t) (buf->last - buf->pos));
+
+            if (b->last != buf->pos) {
+                ngx_memmove(b->last, buf->pos, n);
             }
 
+            b->last += n;
+            buf->pos += n;
+            a->length -= n;
+
+            /* the zero byte is skipped with the next packet header */
             continue;
         }
 
-        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, p->log, 0,
-                       "input filter packet, length:%z, buffer_size:%z",
-                       a->length, ngx_buf_size(buf));
-
         if (p->free) {
             b = p->free->buf;
             p->free = p->free->next;
@@ -809,6 +1319,11 @@ ngx_http_ajp_input_filter(ngx_event_pipe_t *p, ngx_buf_t *buf)
         b->temporary = 1;
         b->recycled = 1;
 
+        if (a->flush) {
+            b->flush = 1;
+            a->flush = 0;
+        }
+
         *prev = b;
         prev = &b->shadow;
 
@@ -896,16 +1411,199 @@ ngx_http_ajp_input_filter(ngx_event_pipe_t *p, ngx_buf_t *buf)
 }
 
 
+/*
+ * The flush of the servlet is passed with the last buffer of the response
+ * not yet passed on. If all of them are, the flush is sent at once. It is
+ * kept pending for the next data buffer only when the response is written
+ * to the temporary file: an empty buffer in p->in would end up there as a
+ * zero size buffer.
+ */
+static void
+ngx_http_ajp_pipe_flush(ngx_event_pipe_t *p, ngx_http_ajp_ctx_t *a,
+    ngx_buf_t *b)
+{
+    ngx_chain_t         *cl;
+    ngx_http_request_t  *r;
+
+    if (b == NULL && p->in) {
+        for (cl = p->in; cl->next; cl = cl->next) { /* void */ }
+        b = cl->buf;
+    }
+
+    /* or the last one written to the temporary file */
+
+    if (b == NULL && p->out) {
+        for (cl = p->out; cl->next; cl = cl->next) { /* void */ }
+        b = cl->buf;
+    }
+
+    if (b) {
+        b->flush = 1;
+        return;
+    }
+
+    if (p->cacheable
+        || (p->temp_file && p->temp_file->file.fd != NGX_INVALID_FILE))
+    {
+        ngx_log_debug0(NGX_LOG_DEBUG_EVENT, p->log, 0, "ajp flush pending");
+
+        a->flush = 1;
+        return;
+    }
+
+    if (p->downstream_error) {
+        return;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, p->log, 0, "ajp flush");
+
+    r = p->input_ctx;
+
+    if (ngx_http_send_special(r, NGX_HTTP_FLUSH) == NGX_ERROR) {
+        p->downstream_error = 1;
+    }
+}
+
+
+/*
+ * The input filter of the response without buffering. The payloads of the
+ * SEND_BODY_CHUNK packets are passed as they are in u->buffer, and all the
+ * framing is parsed byte by byte, so nothing is left in the buffer. Each
+ * buffer is flushed, a zero length packet has nothing more to flush.
+ */
+static ngx_int_t
+ngx_http_ajp_non_buffered_filter(void *data, ssize_t bytes)
+{
+    ngx_http_request_t  *r = data;
+
+    size_t                n;
+    ngx_int_t             rc;
+    ngx_buf_t            *b, *buf;
+    ngx_chain_t          *cl, **ll;
+    ngx_http_ajp_ctx_t   *a;
+    ngx_http_upstream_t  *u;
+
+    a = ngx_http_get_module_ctx(r, ngx_http_ajp_module);
+
+    u = r->upstream;
+    buf = &u->buffer;
+
+    buf->pos = buf->last;
+    buf->last += bytes;
+
+    for (cl = u->out_bufs, ll = &u->out_bufs; cl; cl = cl->next) {
+        ll = &cl->next;
+    }
+
+    while (buf->pos < buf->last) {
+
+        if (a->length == 0) {
+
+            if (a->extra_zero_byte) {
+                if (*buf->pos == 0x00) {
+                    buf->pos++;
+                }
+
+                a->extra_zero_byte = 0;
+                continue;
+            }
+
+            rc = ngx_http_ajp_process_packet_header(r, a, buf);
+
+            if (rc == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+
+            if (rc == NGX_DONE) {
+
+                if (buf->pos < buf->last) {
+                    ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                                  "upstream sent data after the AJP "
+                                  "END_RESPONSE packet");
+                    u->keepalive = 0;
+                    buf->pos = buf->last;
+                }
+
+                break;
+            }
+
+            continue;
+        }
+
+        cl = ngx_chain_get_free_buf(r->pool, &u->free_bufs);
+        if (cl == NULL) {
+            return NGX_ERROR;
+        }
+
+        *ll = cl;
+        ll = &cl->next;
+
+        n = ngx_min(a->length, (size_t) (buf->last - buf->pos));
+
+        b = cl->buf;
+
+        b->flush = 1;
+        b->memory = 1;
+        b->tag = u->output.tag;
+
+        b->pos = buf->pos;
+        buf->pos += n;
+        b->last = buf->pos;
+
+        a->length -= n;
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "ajp non buffered buf %p %z", b->pos, n);
+    }
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_http_ajp_process_packet_header(ngx_http_request_t *r,
     ngx_http_ajp_ctx_t *a, ngx_buf_t *buf)
 {
     int                            reuse;
-    u_char                         ch;
+    u_char                         ch, *p;
     ngx_http_ajp_packet_state_e    state;
 
     state = a->pstate;
 
+    /*
+     * The fast path, the header of the packet is all in the buffer:
+     * 'A' 'B' payload_length type [data_length | reuse]
+     */
+
+    p = buf->pos;
+
+    if (state == ngx_http_ajp_pst_init_state
+        && buf->last - p >= 6 && p[0] == 0x41 && p[1] == 0x42)
+    {
+        if (p[4] == CMD_AJP13_SEND_BODY_CHUNK && buf->last - p >= 7) {
+            a->length = (p[5] << 8) + p[6];
+            a->length_hi = 0x00;
+            a->extra_zero_byte = 1;
+
+            buf->pos += 7;
+
+            return NGX_OK;
+        }
+
+        if (p[4] == CMD_AJP13_END_RESPONSE) {
+            reuse = (p[5] == 0x01) ? 1 : 0;
+
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "ngx_http_ajp_end_response: reuse=%d", reuse);
+
+            buf->pos += 6;
+
+            ngx_http_ajp_end_response(r, reuse);
+
+            return NGX_DONE;
+        }
+    }
+
     while(buf->pos < buf->last) {
 
         ch = *buf->pos++;
@@ -1019,11 +1717,26 @@ ngx_http_ajp_end_response(ngx_http_request_t *r, int reuse)
 
     p = r->upstream->pipe;
 
+    /*
+     * The prefetched packets the container has not asked for would be read
+     * as the next request, but the first one is always swallowed.
+     */
+    if (a->body_packets > a->body_requests + 1) {
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "ajp body packets not read: %ui, requests: %ui",
+                       a->body_packets, a->body_requests);
+        reuse = 0;
+    }
+
     a->ajp_reuse = reuse;
     if (alcf->keep_conn && reuse) {
         r->upstream->keepalive = 1;
     }
+    /* the last buffer of the response flushes a pending flush as well */
+    a->flush = 0;
+
     p->upstream_done = 1;
+    r->upstream->length = 0;
     a->state = ngx_http_ajp_st_response_end;
 }
 
@@ -47,11 +47,40 @@ typedef struct {
     /* reuse in sending request and receiving response */
     ajp_msg_t                      msg;
 
+    /* the whole response packet parsed, in u->buffer or in "hold" */
+    ngx_buf_t                      packet;
+    /* the packet split across the reads, and its size while assembled */
+    ngx_buf_t                     *hold;
+    size_t                         hold_size;
+
     /* save the left request body buffers */
     ngx_chain_t                   *body;
+    /* the last link of the forward request, the data packets follow it */
+    ngx_chain_t                   *request;
+
+    /* the data packet headers and body buffers, recycled once sent */
+    ngx_chain_t                   *free_headers;
+    ngx_chain_t                   *free_bufs;
+    ngx_chain_t                   *busy;
+
+    /* the length asked by the last GET_BODY_CHUNK, 0 for the first packet */
+    size_t                         body_chunk_size;
+
+    /*
+     * the data packets sent, the first one included, and the GET_BODY_CHUNK
+     * requests received, the packets beyond are prefetched
+     */
+    ngx_uint_t                     body_packets;
+    ngx_uint_t                     body_requests;
+    /* the client body has been read, and then all sent */
+    ngx_uint_t                     body_last; /* unsigned :1 */
+    ngx_uint_t                     body_done; /* unsigned :1 */
 
     ngx_uint_t                     ajp_reuse; /* unsigned :1 */
 
+    /* the servlet flushed with no response buffer left to mark */
+    ngx_uint_t                     flush; /* unsigned :1 */
+
 } ngx_http_ajp_ctx_t;
 
 
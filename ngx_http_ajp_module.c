@@ -5,12 +5,17 @@
 #include <ngx_http_ajp.h>
 #include <ngx_http_ajp_module.h>
 #include <ngx_http_ajp_handler.h>
+#include <ngx_http_ajp_upstream.h>
 
 
 static char *ngx_http_ajp_pass(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static char *ngx_http_ajp_store(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char *ngx_http_ajp_param(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_ajp_set_header(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
 
 #if (NGX_HTTP_CACHE)
 static char *ngx_http_ajp_cache(ngx_conf_t *cf, ngx_command_t *cmd,
@@ -31,11 +36,18 @@ static char *ngx_http_ajp_upstream_fail_timeout_unsupported(ngx_conf_t *cf,
 static void *ngx_http_ajp_create_loc_conf(ngx_conf_t *cf);
 static char *ngx_http_ajp_merge_loc_conf(ngx_conf_t *cf,
     void *parent, void *child);
+static ngx_int_t ngx_http_ajp_headers_in_hash(ngx_conf_t *cf,
+    ngx_http_ajp_loc_conf_t *conf, ngx_http_ajp_loc_conf_t *prev);
 
 static ngx_int_t ngx_http_ajp_module_init_process(ngx_cycle_t *cycle);
 
 static ngx_conf_post_t  ngx_http_ajp_lowat_post = { ngx_http_ajp_lowat_check };
 
+/* the prefetched packets are all built with the forward request */
+static ngx_conf_num_bounds_t  ngx_http_ajp_body_prefetch_bounds = {
+    ngx_conf_check_num_bounds, 0, 16
+};
+
 
 static ngx_conf_bitmask_t  ngx_http_ajp_next_upstream_masks[] = {
     { ngx_string("error"),          NGX_HTTP_UPSTREAM_FT_ERROR },
@@ -50,6 +62,23 @@ static ngx_conf_bitmask_t  ngx_http_ajp_next_upstream_masks[] = {
 };
 
 
+static ngx_conf_bitmask_t  ngx_http_ajp_forward_attributes_masks[] = {
+    { ngx_string("remote_user"),    NGX_HTTP_AJP_ATTR_REMOTE_USER },
+    { ngx_string("auth_type"),      NGX_HTTP_AJP_ATTR_AUTH_TYPE },
+    { ngx_string("jvm_route"),      NGX_HTTP_AJP_ATTR_JVM_ROUTE },
+    { ngx_string("ssl"),            NGX_HTTP_AJP_ATTR_SSL },
+    { ngx_string("ssl_cert"),       NGX_HTTP_AJP_ATTR_SSL_CERT },
+    { ngx_string("ssl_cipher"),     NGX_HTTP_AJP_ATTR_SSL_CIPHER },
+    { ngx_string("ssl_session"),    NGX_HTTP_AJP_ATTR_SSL_SESSION },
+    { ngx_string("ssl_key_size"),   NGX_HTTP_AJP_ATTR_SSL_KEY_SIZE },
+    { ngx_string("remote_host"),    NGX_HTTP_AJP_ATTR_REMOTE_HOST },
+    { ngx_string("remote_port"),    NGX_HTTP_AJP_ATTR_REMOTE_PORT },
+    { ngx_string("all"),            NGX_HTTP_AJP_ATTR_ALL },
+    { ngx_string("off"),            NGX_HTTP_AJP_ATTR_OFF },
+    { ngx_null_string, 0 }
+};
+
+
 static ngx_path_init_t  ngx_http_ajp_temp_path = {
     ngx_string(NGX_HTTP_AJP_TEMP_PATH), { 1, 2, 0 }
 };
@@ -99,6 +128,13 @@ static ngx_command_t  ngx_http_ajp_commands[] = {
       offsetof(ngx_http_ajp_loc_conf_t, ajp_header_packet_buffer_size_conf),
       NULL },
 
+    { ngx_string("ajp_header_packet_zero_copy"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_ajp_loc_conf_t, header_zero_copy),
+      NULL },
+
     { ngx_string("ajp_max_data_packet_size"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_str_slot,
@@ -106,6 +142,13 @@ static ngx_command_t  ngx_http_ajp_commands[] = {
       offsetof(ngx_http_ajp_loc_conf_t, max_ajp_data_packet_size_conf),
       NULL },
 
+    { ngx_string("ajp_body_prefetch"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_ajp_loc_conf_t, body_prefetch),
+      &ngx_http_ajp_body_prefetch_bounds },
+
     { ngx_string("ajp_store"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
       ngx_http_ajp_store,
@@ -169,6 +212,17 @@ static ngx_command_t  ngx_http_ajp_commands[] = {
       offsetof(ngx_http_ajp_loc_conf_t, upstream.pass_request_body),
       NULL },
 
+#if (nginx_version >= 1007011)
+
+    { ngx_string("ajp_request_buffering"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_ajp_loc_conf_t, upstream.request_buffering),
+      NULL },
+
+#endif
+
     { ngx_string("ajp_intercept_errors"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
       ngx_conf_set_flag_slot,
@@ -183,6 +237,20 @@ static ngx_command_t  ngx_http_ajp_commands[] = {
       offsetof(ngx_http_ajp_loc_conf_t, upstream.read_timeout),
       NULL },
 
+    { ngx_string("ajp_coalesce_body_chunks"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_ajp_loc_conf_t, coalesce_body_chunks),
+      NULL },
+
+    { ngx_string("ajp_buffering"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_ajp_loc_conf_t, upstream.buffering),
+      NULL },
+
     { ngx_string("ajp_buffers"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE2,
       ngx_conf_set_bufs_slot,
@@ -320,6 +388,27 @@ static ngx_command_t  ngx_http_ajp_commands[] = {
       offsetof(ngx_http_ajp_loc_conf_t, upstream.hide_headers),
       NULL },
 
+    { ngx_string("ajp_pass_header_in"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_str_array_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_ajp_loc_conf_t, pass_headers_in),
+      NULL },
+
+    { ngx_string("ajp_hide_header_in"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_str_array_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_ajp_loc_conf_t, hide_headers_in),
+      NULL },
+
+    { ngx_string("ajp_set_header"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE2,
+      ngx_http_ajp_set_header,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
     { ngx_string("ajp_ignore_headers"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
       ngx_conf_set_bitmask_slot,
@@ -327,6 +416,20 @@ static ngx_command_t  ngx_http_ajp_commands[] = {
       offsetof(ngx_http_ajp_loc_conf_t, upstream.ignore_headers),
       &ngx_http_upstream_ignore_headers_masks },
 
+    { ngx_string("ajp_forward_attributes"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+      ngx_conf_set_bitmask_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_ajp_loc_conf_t, forward_attributes),
+      &ngx_http_ajp_forward_attributes_masks },
+
+    { ngx_string("ajp_param"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE23,
+      ngx_http_ajp_param,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
     { ngx_string("ajp_keep_conn"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
       ngx_conf_set_flag_slot,
@@ -334,6 +437,43 @@ static ngx_command_t  ngx_http_ajp_commands[] = {
       offsetof(ngx_http_ajp_loc_conf_t, keep_conn),
       NULL },
 
+    { ngx_string("ajp_keepalive"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_1MORE,
+      ngx_http_ajp_keepalive,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("ajp_ping"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_FLAG,
+      ngx_http_ajp_ping,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_ajp_upstream_srv_conf_t, ping),
+      NULL },
+
+    { ngx_string("ajp_ping_timeout"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_ajp_upstream_srv_conf_t, ping_timeout),
+      NULL },
+
+    { ngx_string("ajp_ping_interval"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_ajp_upstream_srv_conf_t, ping_interval),
+      NULL },
+
+#if (nginx_version >= 1009000)
+    { ngx_string("ajp_health_check"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_ANY,
+      ngx_http_ajp_health_check,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+#endif
+
       ngx_null_command
 };
 
@@ -345,7 +485,7 @@ static ngx_http_module_t  ngx_http_ajp_module_ctx = {
     NULL,                                  /* create main configuration */
     NULL,                                  /* init main configuration */
 
-    NULL,                                  /* create server configuration */
+    ngx_http_ajp_upstream_create_srv_conf, /* create server configuration */
     NULL,                                  /* merge server configuration */
 
     ngx_http_ajp_create_loc_conf,          /* create location configuration */
@@ -530,6 +670,183 @@ ngx_http_ajp_lowat_check(ngx_conf_t *cf, void *post, void *data)
 }
 
 
+static char *
+ngx_http_ajp_param(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_ajp_loc_conf_t *alcf = conf;
+
+    ngx_str_t                         *value;
+    ngx_uint_t                         skip_empty;
+    ngx_http_ajp_param_t              *param;
+    ngx_http_complex_value_t           cv;
+    ngx_http_compile_complex_value_t   ccv;
+
+    value = cf->args->elts;
+
+    skip_empty = 0;
+
+    if (cf->args->nelts == 4) {
+        if (ngx_strcmp(value[3].data, "if_not_empty") != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[3]);
+            return NGX_CONF_ERROR;
+        }
+
+        skip_empty = 1;
+    }
+
+    if (value[1].len == 0 || value[1].len >= AJP_NULL_STRING_LENGTH
+        || value[2].len >= AJP_NULL_STRING_LENGTH)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid length of \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (alcf->params == NGX_CONF_UNSET_PTR) {
+        alcf->params = ngx_array_create(cf->pool, 4,
+                                        sizeof(ngx_http_ajp_param_t));
+        if (alcf->params == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+    ccv.cf = cf;
+    ccv.value = &value[2];
+    ccv.complex_value = &cv;
+
+    if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (cv.lengths == NULL && cv.value.len == 0 && skip_empty) {
+        return NGX_CONF_OK;
+    }
+
+    param = ngx_array_push(alcf->params);
+    if (param == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_str_null(&param->name);
+    param->value = NULL;
+    param->skip_empty = skip_empty;
+
+    if (cv.lengths == NULL) {
+
+        /* the static value is sent as it is encoded here */
+
+        if (ajp_param_init(cf->pool, param, &value[1], &cv.value) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+
+        return NGX_CONF_OK;
+    }
+
+    param->value = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
+    if (param->value == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    *param->value = cv;
+
+    if (ajp_param_init(cf->pool, param, &value[1], NULL) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_ajp_set_header(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_ajp_loc_conf_t *alcf = conf;
+
+    ngx_str_t                         *value;
+    ngx_http_ajp_param_t              *param;
+    ngx_http_complex_value_t           cv;
+    ngx_http_compile_complex_value_t   ccv;
+
+    value = cf->args->elts;
+
+    if (value[1].len == 0 || value[1].len >= AJP_NULL_STRING_LENGTH
+        || value[2].len >= AJP_NULL_STRING_LENGTH)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid length of \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (alcf->set_headers == NGX_CONF_UNSET_PTR) {
+        alcf->set_headers = ngx_array_create(cf->pool, 4,
+                                             sizeof(ngx_http_ajp_param_t));
+        if (alcf->set_headers == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    param = ngx_array_push(alcf->set_headers);
+    if (param == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    param->name.len = value[1].len;
+    param->name.data = ngx_pnalloc(cf->pool, value[1].len);
+    if (param->name.data == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_strlow(param->name.data, value[1].data, value[1].len);
+
+    param->value = NULL;
+
+    /* an empty value removes the header */
+    param->skip_empty = 1;
+
+    ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+    ccv.cf = cf;
+    ccv.value = &value[2];
+    ccv.complex_value = &cv;
+
+    if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (cv.lengths == NULL) {
+
+        if (cv.value.len == 0) {
+            ngx_str_null(&param->key);
+            return NGX_CONF_OK;
+        }
+
+        if (ajp_set_header_init(cf->pool, param, &value[1], &cv.value)
+            != NGX_OK)
+        {
+            return NGX_CONF_ERROR;
+        }
+
+        return NGX_CONF_OK;
+    }
+
+    param->value = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
+    if (param->value == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    *param->value = cv;
+
+    if (ajp_set_header_init(cf->pool, param, &value[1], NULL) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
 #if (NGX_HTTP_CACHE)
 
 static char *
@@ -689,11 +1006,15 @@ ngx_http_ajp_create_loc_conf(ngx_conf_t *cf)
      *     conf->upstream.location = NULL;
      *     conf->upstream.store_lengths = NULL;
      *     conf->upstream.store_values = NULL;
+     *     conf->forward_attributes = 0;
+     *     conf->headers_in_hash = { NULL, 0 };
+     *     conf->headers_in_allow = 0;
      *
      */
 
     conf->ajp_header_packet_buffer_size_conf = NGX_CONF_UNSET_SIZE;
     conf->max_ajp_data_packet_size_conf = NGX_CONF_UNSET_SIZE;
+    conf->body_prefetch = NGX_CONF_UNSET_UINT;
 
     conf->upstream.store = NGX_CONF_UNSET;
     conf->upstream.store_access = NGX_CONF_UNSET_UINT;
@@ -714,6 +1035,10 @@ ngx_http_ajp_create_loc_conf(ngx_conf_t *cf)
     conf->upstream.pass_request_headers = NGX_CONF_UNSET;
     conf->upstream.pass_request_body = NGX_CONF_UNSET;
 
+#if (nginx_version >= 1007011)
+    conf->upstream.request_buffering = NGX_CONF_UNSET;
+#endif
+
 #if (NGX_HTTP_CACHE)
 #if (nginx_version >= 1007009)
     conf->upstream.cache = NGX_CONF_UNSET;
@@ -734,7 +1059,16 @@ ngx_http_ajp_create_loc_conf(ngx_conf_t *cf)
     /* "ajp_cyclic_temp_file" is disabled */
     conf->upstream.cyclic_temp_file = 0;
 
+    /* the "X-Accel-Buffering" header of the response switches buffering */
+    conf->upstream.change_buffering = 1;
+
     conf->keep_conn = NGX_CONF_UNSET;
+    conf->header_zero_copy = NGX_CONF_UNSET;
+    conf->coalesce_body_chunks = NGX_CONF_UNSET;
+    conf->params = NGX_CONF_UNSET_PTR;
+    conf->pass_headers_in = NGX_CONF_UNSET_PTR;
+    conf->hide_headers_in = NGX_CONF_UNSET_PTR;
+    conf->set_headers = NGX_CONF_UNSET_PTR;
 
     ngx_str_set(&conf->upstream.module, "ajp");
 
@@ -782,6 +1116,9 @@ ngx_http_ajp_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
                               prev->max_ajp_data_packet_size_conf,
                               (size_t) AJP_MSG_BUFFER_SZ);
 
+    ngx_conf_merge_uint_value(conf->body_prefetch,
+                              prev->body_prefetch, 0);
+
     ngx_conf_merge_uint_value(conf->upstream.store_access,
                               prev->upstream.store_access, 0600);
 
@@ -919,6 +1256,16 @@ ngx_http_ajp_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
                                        |NGX_HTTP_UPSTREAM_FT_OFF;
     }
 
+    ngx_conf_merge_bitmask_value(conf->forward_attributes,
+                              prev->forward_attributes,
+                              (NGX_CONF_BITMASK_SET
+                               |NGX_HTTP_AJP_ATTR_ALL));
+
+    if (conf->forward_attributes & NGX_HTTP_AJP_ATTR_OFF) {
+        conf->forward_attributes = NGX_CONF_BITMASK_SET
+                                   |NGX_HTTP_AJP_ATTR_OFF;
+    }
+
     if (ngx_conf_merge_path_value(cf, &conf->upstream.temp_path,
                               prev->upstream.temp_path,
                               &ngx_http_ajp_temp_path)
@@ -1008,10 +1355,18 @@ ngx_http_ajp_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_value(conf->upstream.pass_request_body,
                          prev->upstream.pass_request_body, 1);
 
+#if (nginx_version >= 1007011)
+    ngx_conf_merge_value(conf->upstream.request_buffering,
+                         prev->upstream.request_buffering, 1);
+#endif
+
     ngx_conf_merge_value(conf->upstream.intercept_errors,
                          prev->upstream.intercept_errors, 0);
 
     ngx_conf_merge_value(conf->keep_conn, prev->keep_conn, 0);
+    ngx_conf_merge_value(conf->header_zero_copy, prev->header_zero_copy, 0);
+    ngx_conf_merge_value(conf->coalesce_body_chunks,
+                         prev->coalesce_body_chunks, 0);
 
     hash.max_size = 512;
     hash.bucket_size = ngx_align(64, ngx_cacheline_size);
@@ -1038,18 +1393,180 @@ ngx_http_ajp_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
         conf->upstream.upstream = prev->upstream.upstream;
     }
 
+    ngx_conf_merge_ptr_value(conf->params, prev->params, NULL);
+
+    if (ngx_http_ajp_headers_in_hash(cf, conf, prev) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
     if (conf->ajp_lengths == NULL) {
         conf->ajp_lengths = prev->ajp_lengths;
         conf->ajp_values = prev->ajp_values;
     }
 
+    if (conf->upstream.upstream || conf->ajp_lengths) {
+        if (ajp_template_init() != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
     return NGX_CONF_OK;
 }
 
 
-static ngx_int_t ngx_http_ajp_module_init_process(ngx_cycle_t *cycle)
+static ngx_int_t
+ngx_http_ajp_headers_in_add(ngx_conf_t *cf, ngx_array_t *keys,
+    ngx_str_t *name, ngx_uint_t action)
 {
-    ajp_header_init();
+    u_char          *p;
+    ngx_uint_t       i;
+    ngx_hash_key_t  *hk;
+
+    hk = keys->elts;
+
+    /* the first rule of a header wins */
+
+    for (i = 0; i < keys->nelts; i++) {
+        if (hk[i].key.len == name->len
+            && ngx_strncasecmp(hk[i].key.data, name->data, name->len) == 0)
+        {
+            return NGX_OK;
+        }
+    }
+
+    p = ngx_pnalloc(cf->pool, name->len);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_strlow(p, name->data, name->len);
+
+    hk = ngx_array_push(keys);
+    if (hk == NULL) {
+        return NGX_ERROR;
+    }
+
+    hk->key.len = name->len;
+    hk->key.data = p;
+    hk->key_hash = ngx_hash_key(p, name->len);
+    hk->value = (void *) action;
 
     return NGX_OK;
 }
+
+
+/*
+ * The rules of "ajp_set_header", "ajp_hide_header_in" and
+ * "ajp_pass_header_in" are looked up by the hash of the request headers,
+ * which is already computed by the request parser.
+ */
+static ngx_int_t
+ngx_http_ajp_headers_in_hash(ngx_conf_t *cf, ngx_http_ajp_loc_conf_t *conf,
+    ngx_http_ajp_loc_conf_t *prev)
+{
+    ngx_str_t             *name;
+    ngx_uint_t             i;
+    ngx_array_t            keys;
+    ngx_hash_init_t        hash;
+    ngx_http_ajp_param_t  *param;
+
+    if (conf->pass_headers_in == NGX_CONF_UNSET_PTR
+        && conf->hide_headers_in == NGX_CONF_UNSET_PTR
+        && conf->set_headers == NGX_CONF_UNSET_PTR
+        && prev->headers_in_hash.buckets)
+    {
+        conf->pass_headers_in = prev->pass_headers_in;
+        conf->hide_headers_in = prev->hide_headers_in;
+        conf->set_headers = prev->set_headers;
+        conf->headers_in_hash = prev->headers_in_hash;
+        conf->headers_in_allow = prev->headers_in_allow;
+
+        return NGX_OK;
+    }
+
+    ngx_conf_merge_ptr_value(conf->pass_headers_in, prev->pass_headers_in,
+                             NULL);
+    ngx_conf_merge_ptr_value(conf->hide_headers_in, prev->hide_headers_in,
+                             NULL);
+    ngx_conf_merge_ptr_value(conf->set_headers, prev->set_headers, NULL);
+
+    if (conf->pass_headers_in == NULL
+        && conf->hide_headers_in == NULL
+        && conf->set_headers == NULL)
+    {
+        return NGX_OK;
+    }
+
+    if (ngx_array_init(&keys, cf->temp_pool, 8, sizeof(ngx_hash_key_t))
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (conf->set_headers) {
+        param = conf->set_headers->elts;
+
+        for (i = 0; i < conf->set_headers->nelts; i++) {
+            if (ngx_http_ajp_headers_in_add(cf, &keys, &param[i].name,
+                                            NGX_HTTP_AJP_HEADER_IN_SET)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+        }
+    }
+
+    if (conf->hide_headers_in) {
+        name = conf->hide_headers_in->elts;
+
+        for (i = 0; i < conf->hide_headers_in->nelts; i++) {
+            if (ngx_http_ajp_headers_in_add(cf, &keys, &name[i],
+                                            NGX_HTTP_AJP_HEADER_IN_HIDE)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+        }
+    }
+
+    if (conf->pass_headers_in) {
+        name = conf->pass_headers_in->elts;
+
+        for (i = 0; i < conf->pass_headers_in->nelts; i++) {
+            if (ngx_http_ajp_headers_in_add(cf, &keys, &name[i],
+                                            NGX_HTTP_AJP_HEADER_IN_PASS)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+        }
+
+        conf->headers_in_allow = 1;
+    }
+
+    hash.hash = &conf->headers_in_hash;
+    hash.key = ngx_hash_key_lc;
+    hash.max_size = 512;
+    hash.bucket_size = ngx_align(64, ngx_cacheline_size);
+    hash.name = "ajp_headers_in_hash";
+    hash.pool = cf->pool;
+    hash.temp_pool = NULL;
+
+    return ngx_hash_init(&hash, keys.elts, keys.nelts);
+}
+
+
+static ngx_int_t ngx_http_ajp_module_init_process(ngx_cycle_t *cycle)
+{
+    ngx_http_upstream_main_conf_t  *umcf;
+
+    umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+
+    ajp_header_init(umcf);
+
+    if (ajp_ssl_init() != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return ngx_http_ajp_upstream_init_process(cycle);
+}
@@ -8,17 +8,92 @@
 #include <ngx_http.h>
 
 
+/* the request attributes for "ajp_forward_attributes" */
+#define NGX_HTTP_AJP_ATTR_OFF           0x0002
+#define NGX_HTTP_AJP_ATTR_REMOTE_USER   0x0004
+#define NGX_HTTP_AJP_ATTR_AUTH_TYPE     0x0008
+#define NGX_HTTP_AJP_ATTR_JVM_ROUTE     0x0010
+#define NGX_HTTP_AJP_ATTR_SSL_CERT      0x0020
+#define NGX_HTTP_AJP_ATTR_SSL_CIPHER    0x0040
+#define NGX_HTTP_AJP_ATTR_SSL_SESSION   0x0080
+#define NGX_HTTP_AJP_ATTR_SSL_KEY_SIZE  0x0100
+#define NGX_HTTP_AJP_ATTR_REMOTE_HOST   0x0200
+#define NGX_HTTP_AJP_ATTR_REMOTE_PORT   0x0400
+
+#define NGX_HTTP_AJP_ATTR_SSL           (NGX_HTTP_AJP_ATTR_SSL_CERT          \
+                                         |NGX_HTTP_AJP_ATTR_SSL_CIPHER       \
+                                         |NGX_HTTP_AJP_ATTR_SSL_SESSION      \
+                                         |NGX_HTTP_AJP_ATTR_SSL_KEY_SIZE)
+
+#define NGX_HTTP_AJP_ATTR_ALL           (NGX_HTTP_AJP_ATTR_REMOTE_USER       \
+                                         |NGX_HTTP_AJP_ATTR_AUTH_TYPE        \
+                                         |NGX_HTTP_AJP_ATTR_JVM_ROUTE        \
+                                         |NGX_HTTP_AJP_ATTR_SSL              \
+                                         |NGX_HTTP_AJP_ATTR_REMOTE_HOST      \
+                                         |NGX_HTTP_AJP_ATTR_REMOTE_PORT)
+
+
+/* the values of the request headers in "headers_in_hash" */
+#define NGX_HTTP_AJP_HEADER_IN_PASS     1
+#define NGX_HTTP_AJP_HEADER_IN_HIDE     2
+#define NGX_HTTP_AJP_HEADER_IN_SET      3
+
+
+/*
+ * The pre-serialized segments of the FORWARD_REQUEST packet, which are the
+ * same in all the requests.
+ */
+typedef struct {
+    /* prefix, method slot and the protocol string "HTTP/1.1" */
+    ngx_str_t                  head11;
+    /* prefix, method slot and the protocol string "HTTP/1.0" */
+    ngx_str_t                  head10;
+    /* SC_A_REQ_ATTRIBUTE and the name of SC_A_REQ_REMOTE_PORT */
+    ngx_str_t                  remote_port;
+} ngx_http_ajp_template_t;
+
+
+/* an "ajp_param" or an "ajp_set_header" */
+typedef struct {
+    /* the name in lowercase for "ajp_set_header" */
+    ngx_str_t                  name;
+    /*
+     * SC_A_REQ_ATTRIBUTE and the name, or the header name, followed by
+     * the value if static, empty if the header is removed
+     */
+    ngx_str_t                  key;
+    /* NULL if the value is static and already in the key */
+    ngx_http_complex_value_t  *value;
+    ngx_uint_t                 skip_empty;
+} ngx_http_ajp_param_t;
+
+
 typedef struct {
     ngx_http_upstream_conf_t   upstream;
 
     size_t                     ajp_header_packet_buffer_size_conf;
     size_t                     max_ajp_data_packet_size_conf;
+    ngx_uint_t                 body_prefetch;
+
+    ngx_flag_t                 header_zero_copy;
+    ngx_flag_t                 coalesce_body_chunks;
 
     ngx_array_t               *ajp_lengths;
     ngx_array_t               *ajp_values;
 
     ngx_flag_t                 keep_conn;
 
+    ngx_uint_t                 forward_attributes;
+
+    ngx_array_t               *params;
+
+    ngx_array_t               *pass_headers_in;
+    ngx_array_t               *hide_headers_in;
+    ngx_array_t               *set_headers;
+    ngx_hash_t                 headers_in_hash;
+    /* only the headers in "headers_in_hash" are passed */
+    ngx_uint_t                 headers_in_allow;
+
 #if (NGX_HTTP_CACHE)
     ngx_http_complex_value_t   cache_key;
 #endif
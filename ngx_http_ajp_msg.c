@@ -80,6 +80,71 @@ ajp_msg_reuse(ajp_msg_t *msg)
 }
 
 
+static void
+ajp_msg_gather_link(ajp_msg_t *msg, u_char *pos, u_char *last)
+{
+    ngx_buf_t   *b;
+    ngx_chain_t *cl;
+
+    if (pos == last) {
+        return;
+    }
+
+    /* the links are preallocated by ajp_msg_gather_init() */
+    cl = msg->free;
+    msg->free = cl->next;
+
+    b = cl->buf;
+
+    /* the upstream resets pos to start when the request is resent */
+    b->pos = b->start = pos;
+    b->last = b->end = last;
+    b->memory = 1;
+
+    cl->next = NULL;
+
+    *msg->last_out = cl;
+    msg->last_out = &cl->next;
+}
+
+
+ngx_int_t
+ajp_msg_gather_init(ajp_msg_t *msg, ngx_pool_t *pool)
+{
+    ngx_buf_t   *b;
+    ngx_uint_t   i, n;
+    ngx_chain_t *cl;
+
+    /* a segment before each reference, the reference and the tail */
+    n = 2 * msg->nrefs + 1;
+
+    cl = ngx_palloc(pool, n * sizeof(ngx_chain_t));
+    if (cl == NULL) {
+        return NGX_ERROR;
+    }
+
+    b = ngx_pcalloc(pool, n * sizeof(ngx_buf_t));
+    if (b == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < n; i++) {
+        cl[i].buf = &b[i];
+        cl[i].next = (i + 1 < n) ? &cl[i + 1] : NULL;
+    }
+
+    msg->free = cl;
+    msg->out = NULL;
+    msg->last_out = &msg->out;
+    msg->seg = msg->buf->start;
+
+    msg->max_refs = msg->nrefs;
+    msg->nrefs = 0;
+
+    return NGX_OK;
+}
+
+
 ngx_int_t
 ajp_msg_end(ajp_msg_t *msg)
 {
@@ -87,7 +152,7 @@ ajp_msg_end(ajp_msg_t *msg)
     ngx_buf_t *buf;
 
     buf = msg->buf;
-    len = buf->last - buf->start - AJP_HEADER_LEN;
+    len = buf->last - buf->start - AJP_HEADER_LEN + msg->len;
 
     if (msg->server_side) {
         buf->start[0] = 0x41;
@@ -102,6 +167,10 @@ ajp_msg_end(ajp_msg_t *msg)
 
     buf->pos = buf->start;
 
+    if (msg->gather) {
+        ajp_msg_gather_link(msg, msg->seg, buf->last);
+    }
+
     return NGX_OK;
 }
 
@@ -198,6 +267,118 @@ ajp_msg_append_string(ajp_msg_t *msg, ngx_str_t *value)
 }
 
 
+ngx_int_t
+ajp_msg_append_bytes(ajp_msg_t *msg, ngx_str_t *value)
+{
+    ngx_buf_t *buf;
+
+    buf = msg->buf;
+
+    if ((buf->last + value->len) > buf->end) {
+        return ajp_log_overflow(msg, "ajp_msg_append_bytes");
+    }
+
+    buf->last = ngx_cpymem(buf->last, value->data, value->len);
+
+    return NGX_OK;
+}
+
+
+size_t
+ajp_msg_size_string(ajp_msg_t *msg, ngx_str_t *value)
+{
+    if (value == NULL) {
+        return 2;
+    }
+
+    if (msg->gather
+        && value->len >= AJP_MSG_GATHER_MIN_LEN
+        && msg->nrefs < AJP_MSG_GATHER_MAX_REFS)
+    {
+        msg->len += value->len;
+        msg->nrefs++;
+
+        return 2 + 1;
+    }
+
+    return 2 + value->len + 1;
+}
+
+
+void
+ajp_msg_put_string(ajp_msg_t *msg, ngx_str_t *value)
+{
+    u_char *p;
+
+    if (value == NULL) {
+        ajp_msg_put_uint16(msg, AJP_NULL_STRING_LENGTH);
+        return;
+    }
+
+    p = msg->buf->last;
+
+    *p++ = (u_char)((value->len >> 8) & 0xFF);
+    *p++ = (u_char)(value->len & 0xFF);
+
+    /* the same decision as in ajp_msg_size_string() */
+    if (msg->gather
+        && value->len >= AJP_MSG_GATHER_MIN_LEN
+        && msg->nrefs < msg->max_refs)
+    {
+        ajp_msg_gather_link(msg, msg->seg, p);
+        ajp_msg_gather_link(msg, value->data, value->data + value->len);
+
+        msg->nrefs++;
+        msg->seg = p;
+
+    } else {
+        p = ngx_cpymem(p, value->data, value->len);
+    }
+
+    *p++ = '\0';
+
+    msg->buf->last = p;
+}
+
+
+size_t
+ajp_msg_size_bytes(ajp_msg_t *msg, ngx_str_t *value)
+{
+    if (msg->gather
+        && value->len >= AJP_MSG_GATHER_MIN_LEN
+        && msg->nrefs < AJP_MSG_GATHER_MAX_REFS)
+    {
+        msg->len += value->len;
+        msg->nrefs++;
+
+        return 0;
+    }
+
+    return value->len;
+}
+
+
+void
+ajp_msg_put_bytes(ajp_msg_t *msg, ngx_str_t *value)
+{
+    /* the same decision as in ajp_msg_size_bytes() */
+    if (msg->gather
+        && value->len >= AJP_MSG_GATHER_MIN_LEN
+        && msg->nrefs < msg->max_refs)
+    {
+        ajp_msg_gather_link(msg, msg->seg, msg->buf->last);
+        ajp_msg_gather_link(msg, value->data, value->data + value->len);
+
+        msg->nrefs++;
+        msg->seg = msg->buf->last;
+
+        return;
+    }
+
+    msg->buf->last = ngx_cpymem(msg->buf->last, value->data, value->len);
+}
+
+
 ngx_int_t
 ajp_msg_get_uint32(ajp_msg_t *msg, uint32_t *rvalue)
 {
@@ -450,7 +631,11 @@ ajp_msg_dump(ngx_pool_t *pool, ajp_msg_t *msg, char *err)
 }
 
 
-/* TODO: health check */
+/*
+ * The PING packet of the web server, kept for the completeness of the
+ * protocol. The containers answer CPING, which the pool and the health
+ * checks send.
+ */
 ngx_int_t
 ajp_msg_serialize_ping(ajp_msg_t *msg)
 {
@@ -466,7 +651,6 @@ ajp_msg_serialize_ping(ajp_msg_t *msg)
 }
 
 
-/* TODO: health check */
 ngx_int_t
 ajp_msg_serialize_cping(ajp_msg_t *msg)
 {
@@ -0,0 +1,1391 @@
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_http_ajp.h>
+#include <ngx_http_ajp_module.h>
+#include <ngx_http_ajp_upstream.h>
+
+
+/* the idle connections to one peer */
+typedef struct {
+    ngx_http_ajp_upstream_srv_conf_t   *conf;
+
+    ngx_queue_t                         queue;
+
+    /* the most recently used connection is the head */
+    ngx_queue_t                         idle;
+    ngx_queue_t                         free;
+    ngx_uint_t                          nidle;
+
+    socklen_t                           socklen;
+    u_char                              sockaddr[NGX_SOCKADDRLEN];
+} ngx_http_ajp_upstream_pool_t;
+
+
+typedef struct {
+    ngx_http_ajp_upstream_pool_t       *pool;
+    ngx_queue_t                         queue;
+    ngx_connection_t                   *connection;
+    /* CPING has been sent, the connection is not used until CPONG */
+    ngx_uint_t                          ping; /* unsigned :1 */
+} ngx_http_ajp_upstream_cache_t;
+
+
+#if (nginx_version >= 1009000)
+
+/* the state of a peer shared by the workers */
+typedef struct {
+    /* the last check started, it is claimed by one worker */
+    ngx_atomic_t                        checked;
+    ngx_msec_t                          rtt;
+    ngx_uint_t                          fails;
+    ngx_uint_t                          passes;
+    ngx_uint_t                          down;
+
+    /* the address of the peer, the state follows it across reloads */
+    socklen_t                           socklen;
+    u_char                              sockaddr[NGX_SOCKADDRLEN];
+} ngx_http_ajp_check_peer_t;
+
+
+/* the peer as it is configured */
+typedef struct {
+    struct sockaddr                    *sockaddr;
+    socklen_t                           socklen;
+    /* the "down" parameter of the "server" directive */
+    ngx_uint_t                          down;
+} ngx_http_ajp_check_server_t;
+
+
+/* the check of a peer run by a worker */
+typedef struct {
+    ngx_http_ajp_check_t               *check;
+    ngx_uint_t                          index;
+
+    ngx_peer_connection_t               pc;
+    ngx_msec_t                          start;
+    size_t                              sent;
+    size_t                              received;
+    u_char                              buf[AJP_HEADER_LEN + 1]; /* CPONG */
+
+    socklen_t                           socklen;
+    u_char                              sockaddr[NGX_SOCKADDRLEN];
+
+    ngx_uint_t                          pending; /* unsigned :1 */
+    ngx_uint_t                          busy; /* unsigned :1 */
+} ngx_http_ajp_check_ctx_t;
+
+
+struct ngx_http_ajp_check_s {
+    ngx_msec_t                          interval;
+    ngx_msec_t                          timeout;
+    ngx_uint_t                          fails;
+    ngx_uint_t                          passes;
+
+    ngx_http_upstream_srv_conf_t       *upstream;
+    ngx_http_ajp_upstream_srv_conf_t   *conf;
+
+    /* the primary peers first, then the backup ones */
+    ngx_uint_t                          number;
+    ngx_http_ajp_check_server_t        *servers;
+
+    ngx_http_ajp_check_peer_t          *sh;
+
+    ngx_http_ajp_check_ctx_t           *ctx;
+    ngx_event_t                         timer;
+};
+
+#endif
+
+
+typedef struct {
+    ngx_http_ajp_upstream_srv_conf_t   *conf;
+
+    ngx_http_upstream_t                *upstream;
+
+    void                               *data;
+
+    ngx_event_get_peer_pt               original_get_peer;
+    ngx_event_free_peer_pt              original_free_peer;
+} ngx_http_ajp_upstream_peer_data_t;
+
+
+static ngx_int_t ngx_http_ajp_upstream_init(ngx_conf_t *cf,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_ajp_upstream_init_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_ajp_upstream_get_peer(ngx_peer_connection_t *pc,
+    void *data);
+static void ngx_http_ajp_upstream_free_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state);
+
+static ngx_http_ajp_upstream_pool_t *ngx_http_ajp_upstream_get_pool(
+    ngx_http_ajp_upstream_srv_conf_t *conf, ngx_peer_connection_t *pc,
+    ngx_uint_t create);
+
+static void ngx_http_ajp_upstream_ping_handler(ngx_event_t *ev);
+static void ngx_http_ajp_upstream_close_handler(ngx_event_t *ev);
+static void ngx_http_ajp_upstream_drop(ngx_http_ajp_upstream_cache_t *item);
+static void ngx_http_ajp_upstream_close(ngx_connection_t *c);
+
+static void ngx_http_ajp_upstream_hook(ngx_conf_t *cf,
+    ngx_http_ajp_upstream_srv_conf_t *ascf);
+
+#if (nginx_version >= 1009000)
+static ngx_int_t ngx_http_ajp_upstream_init_check(ngx_conf_t *cf,
+    ngx_http_upstream_srv_conf_t *us, ngx_http_ajp_check_t *check);
+static ngx_int_t ngx_http_ajp_upstream_init_check_zone(
+    ngx_shm_zone_t *shm_zone, void *data);
+static void ngx_http_ajp_upstream_check_timer(ngx_event_t *ev);
+static void ngx_http_ajp_upstream_check_peer(ngx_http_ajp_check_ctx_t *ctx);
+static void ngx_http_ajp_upstream_check_handler(ngx_event_t *ev);
+static void ngx_http_ajp_upstream_check_done(ngx_http_ajp_check_ctx_t *ctx,
+    ngx_uint_t up);
+#endif
+
+
+static u_char  ngx_http_ajp_cpong[] = {
+    0x41, 0x42, 0x00, 0x01, CMD_AJP13_CPONG
+};
+
+
+void *
+ngx_http_ajp_upstream_create_srv_conf(ngx_conf_t *cf)
+{
+    ngx_http_ajp_upstream_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_ajp_upstream_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->max_idle = 0;
+     *     conf->min_idle = 0;
+     *     conf->original_init_upstream = NULL;
+     *     conf->original_init_peer = NULL;
+     *     conf->cping = { 0, NULL };
+     *     conf->check = NULL;
+     */
+
+    conf->timeout = 60000;
+
+    conf->ping = NGX_CONF_UNSET;
+    conf->ping_timeout = NGX_CONF_UNSET_MSEC;
+    conf->ping_interval = NGX_CONF_UNSET_MSEC;
+
+    ngx_queue_init(&conf->pools);
+
+    return conf;
+}
+
+
+char *
+ngx_http_ajp_keepalive(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_ajp_upstream_srv_conf_t *ascf = conf;
+
+    ngx_int_t                      n;
+    ngx_str_t                     *value, s;
+    ngx_uint_t                     i;
+
+    if (ascf->max_idle) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    n = ngx_atoi(value[1].data, value[1].len);
+
+    if (n == NGX_ERROR || n == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid value \"%V\" in \"%V\" directive",
+                           &value[1], &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    ascf->max_idle = n;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "min_idle=", 9) == 0) {
+
+            n = ngx_atoi(value[i].data + 9, value[i].len - 9);
+
+            if (n == NGX_ERROR || (ngx_uint_t) n > ascf->max_idle) {
+                goto invalid;
+            }
+
+            ascf->min_idle = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
+
+            s.len = value[i].len - 8;
+            s.data = value[i].data + 8;
+
+            ascf->timeout = ngx_parse_time(&s, 0);
+
+            if (ascf->timeout == (ngx_msec_t) NGX_ERROR
+                || ascf->timeout == 0)
+            {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    ngx_http_ajp_upstream_hook(cf, ascf);
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+/* the upstream is hooked to check that "ajp_keepalive" is there too */
+char *
+ngx_http_ajp_ping(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_ajp_upstream_srv_conf_t *ascf = conf;
+
+    char  *rv;
+
+    rv = ngx_conf_set_flag_slot(cf, cmd, conf);
+    if (rv != NGX_CONF_OK) {
+        return rv;
+    }
+
+    ngx_http_ajp_upstream_hook(cf, ascf);
+
+    return NGX_CONF_OK;
+}
+
+
+#if (nginx_version >= 1009000)
+
+char *
+ngx_http_ajp_health_check(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_ajp_upstream_srv_conf_t *ascf = conf;
+
+    ngx_int_t              n;
+    ngx_str_t             *value, s;
+    ngx_uint_t             i;
+    ngx_http_ajp_check_t  *check;
+
+    if (ascf->check) {
+        return "is duplicate";
+    }
+
+    check = ngx_pcalloc(cf->pool, sizeof(ngx_http_ajp_check_t));
+    if (check == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    check->interval = 5000;
+    check->timeout = 2000;
+    check->fails = 1;
+    check->passes = 1;
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            check->interval = ngx_parse_time(&s, 0);
+
+            if (check->interval == (ngx_msec_t) NGX_ERROR
+                || check->interval == 0)
+            {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
+
+            s.len = value[i].len - 8;
+            s.data = value[i].data + 8;
+
+            check->timeout = ngx_parse_time(&s, 0);
+
+            if (check->timeout == (ngx_msec_t) NGX_ERROR
+                || check->timeout == 0)
+            {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "fails=", 6) == 0) {
+
+            n = ngx_atoi(value[i].data + 6, value[i].len - 6);
+
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            check->fails = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "passes=", 7) == 0) {
+
+            n = ngx_atoi(value[i].data + 7, value[i].len - 7);
+
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            check->passes = n;
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    if (check->timeout > check->interval) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"timeout\" must not exceed \"interval\"");
+        return NGX_CONF_ERROR;
+    }
+
+    check->conf = ascf;
+    check->upstream = ngx_http_conf_get_module_srv_conf(cf,
+                                                   ngx_http_upstream_module);
+    ascf->check = check;
+
+    ngx_http_ajp_upstream_hook(cf, ascf);
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+#endif
+
+
+/*
+ * "ajp_keepalive" and "ajp_health_check" share the initialization of the
+ * upstream, which wraps the one of the balancer.
+ */
+static void
+ngx_http_ajp_upstream_hook(ngx_conf_t *cf,
+    ngx_http_ajp_upstream_srv_conf_t *ascf)
+{
+    ngx_http_upstream_srv_conf_t  *uscf;
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    if (uscf->peer.init_upstream == ngx_http_ajp_upstream_init) {
+        return;
+    }
+
+    ascf->original_init_upstream = uscf->peer.init_upstream
+                                   ? uscf->peer.init_upstream
+                                   : ngx_http_upstream_init_round_robin;
+
+    uscf->peer.init_upstream = ngx_http_ajp_upstream_init;
+}
+
+
+static ngx_int_t
+ngx_http_ajp_upstream_init(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us)
+{
+    ajp_msg_t                         *msg;
+    ngx_http_ajp_upstream_srv_conf_t  *ascf;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, cf->log, 0, "init ajp upstream pool");
+
+    ascf = ngx_http_conf_upstream_srv_conf(us, ngx_http_ajp_module);
+
+    ngx_conf_init_value(ascf->ping, 0);
+    ngx_conf_init_msec_value(ascf->ping_timeout, 10000);
+    ngx_conf_init_msec_value(ascf->ping_interval, 30000);
+
+    if (ascf->ping && ascf->max_idle == 0) {
+        ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                      "\"ajp_ping\" requires \"ajp_keepalive\" "
+                      "in upstream \"%V\" in %s:%ui",
+                      &us->host, us->file_name, us->line);
+        return NGX_ERROR;
+    }
+
+    if (ascf->ping || ascf->check) {
+        if (ajp_msg_create(cf->pool, AJP_HEADER_SZ, &msg) != NGX_OK
+            || ajp_msg_serialize_cping(msg) != NGX_OK
+            || ajp_msg_end(msg) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        ascf->cping.data = msg->buf->pos;
+        ascf->cping.len = msg->buf->last - msg->buf->pos;
+    }
+
+    if (ascf->original_init_upstream(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+#if (nginx_version >= 1009000)
+
+    if (ascf->check
+        && ngx_http_ajp_upstream_init_check(cf, us, ascf->check) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+#endif
+
+    if (ascf->max_idle == 0) {
+        return NGX_OK;
+    }
+
+    ascf->original_init_peer = us->peer.init;
+
+    us->peer.init = ngx_http_ajp_upstream_init_peer;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_ajp_upstream_init_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_ajp_upstream_peer_data_t  *ap;
+    ngx_http_ajp_upstream_srv_conf_t   *ascf;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "init ajp upstream peer");
+
+    ascf = ngx_http_conf_upstream_srv_conf(us, ngx_http_ajp_module);
+
+    ap = ngx_palloc(r->pool, sizeof(ngx_http_ajp_upstream_peer_data_t));
+    if (ap == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (ascf->original_init_peer(r, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ap->conf = ascf;
+    ap->upstream = r->upstream;
+    ap->data = r->upstream->peer.data;
+    ap->original_get_peer = r->upstream->peer.get;
+    ap->original_free_peer = r->upstream->peer.free;
+
+    r->upstream->peer.data = ap;
+    r->upstream->peer.get = ngx_http_ajp_upstream_get_peer;
+    r->upstream->peer.free = ngx_http_ajp_upstream_free_peer;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_ajp_upstream_get_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_ajp_upstream_peer_data_t  *ap = data;
+
+    ngx_int_t                       rc;
+    ngx_queue_t                    *q;
+    ngx_connection_t               *c;
+    ngx_http_ajp_upstream_pool_t   *pool;
+    ngx_http_ajp_upstream_cache_t  *item;
+
+    /* the balancer picks the peer, the pool only has its connections */
+
+    rc = ap->original_get_peer(pc, ap->data);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    pool = ngx_http_ajp_upstream_get_pool(ap->conf, pc, 0);
+
+    if (pool == NULL) {
+        return NGX_OK;
+    }
+
+    for (q = ngx_queue_head(&pool->idle);
+         q != ngx_queue_sentinel(&pool->idle);
+         q = ngx_queue_next(q))
+    {
+        item = ngx_queue_data(q, ngx_http_ajp_upstream_cache_t, queue);
+
+        /* the connections still waiting for CPONG are skipped */
+
+        if (!item->ping) {
+            goto found;
+        }
+    }
+
+    return NGX_OK;
+
+found:
+
+    ngx_queue_remove(q);
+    ngx_queue_insert_head(&pool->free, q);
+    pool->nidle--;
+
+    c = item->connection;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "get ajp upstream connection %p, idle: %ui",
+                   c, pool->nidle);
+
+    c->idle = 0;
+    c->sent = 0;
+    c->data = NULL;
+    c->log = pc->log;
+    c->read->log = pc->log;
+    c->write->log = pc->log;
+    c->pool->log = pc->log;
+
+    if (c->read->timer_set) {
+        ngx_del_timer(c->read);
+    }
+
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    pc->connection = c;
+    pc->cached = 1;
+
+    return NGX_DONE;
+}
+
+
+static void
+ngx_http_ajp_upstream_free_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
+{
+    ngx_http_ajp_upstream_peer_data_t  *ap = data;
+
+    ngx_queue_t                    *q;
+    ngx_connection_t               *c;
+    ngx_http_upstream_t            *u;
+    ngx_http_ajp_upstream_pool_t   *pool;
+    ngx_http_ajp_upstream_cache_t  *item;
+
+    u = ap->upstream;
+    c = pc->connection;
+
+    if (state & NGX_PEER_FAILED
+        || c == NULL
+        || c->read->eof
+        || c->read->error
+        || c->read->timedout
+        || c->write->error
+        || c->write->timedout)
+    {
+        goto invalid;
+    }
+
+    /* set only if END_RESPONSE allowed the reuse of the connection */
+    if (!u->keepalive) {
+        goto invalid;
+    }
+
+    if (ngx_terminate || ngx_exiting) {
+        goto invalid;
+    }
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        goto invalid;
+    }
+
+    pool = ngx_http_ajp_upstream_get_pool(ap->conf, pc, 1);
+
+    if (pool == NULL) {
+        goto invalid;
+    }
+
+    if (ngx_queue_empty(&pool->free)) {
+
+        /* the least recently used connection makes room */
+
+        q = ngx_queue_last(&pool->idle);
+        ngx_queue_remove(q);
+
+        item = ngx_queue_data(q, ngx_http_ajp_upstream_cache_t, queue);
+
+        ngx_http_ajp_upstream_close(item->connection);
+
+    } else {
+        q = ngx_queue_head(&pool->free);
+        ngx_queue_remove(q);
+
+        item = ngx_queue_data(q, ngx_http_ajp_upstream_cache_t, queue);
+
+        pool->nidle++;
+    }
+
+    ngx_queue_insert_head(&pool->idle, q);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "free ajp upstream connection %p, idle: %ui",
+                   c, pool->nidle);
+
+    item->connection = c;
+    item->ping = 0;
+
+    pc->connection = NULL;
+
+    c->read->delayed = 0;
+    ngx_add_timer(c->read, ap->conf->timeout);
+
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    if (ap->conf->ping) {
+        ngx_add_timer(c->write, ap->conf->ping_interval);
+    }
+
+    c->write->handler = ngx_http_ajp_upstream_ping_handler;
+    c->read->handler = ngx_http_ajp_upstream_close_handler;
+
+    c->data = item;
+    c->idle = 1;
+    c->log = ngx_cycle->log;
+    c->read->log = ngx_cycle->log;
+    c->write->log = ngx_cycle->log;
+    c->pool->log = ngx_cycle->log;
+
+    if (c->read->ready) {
+        ngx_http_ajp_upstream_close_handler(c->read);
+    }
+
+invalid:
+
+    ap->original_free_peer(pc, ap->data, state);
+}
+
+
+/*
+ * The pools are keyed by the address of the peer, so they follow the
+ * peers whatever the balancer. A pool and its slots are allocated at
+ * once, the first time a connection to the peer is kept.
+ */
+static ngx_http_ajp_upstream_pool_t *
+ngx_http_ajp_upstream_get_pool(ngx_http_ajp_upstream_srv_conf_t *conf,
+    ngx_peer_connection_t *pc, ngx_uint_t create)
+{
+    ngx_uint_t                      i;
+    ngx_queue_t                    *q;
+    ngx_http_ajp_upstream_pool_t   *pool;
+    ngx_http_ajp_upstream_cache_t  *cache;
+
+    for (q = ngx_queue_head(&conf->pools);
+         q != ngx_queue_sentinel(&conf->pools);
+         q = ngx_queue_next(q))
+    {
+        pool = ngx_queue_data(q, ngx_http_ajp_upstream_pool_t, queue);
+
+        if (ngx_memn2cmp(pool->sockaddr, (u_char *) pc->sockaddr,
+                         pool->socklen, pc->socklen)
+            == 0)
+        {
+            return pool;
+        }
+    }
+
+    if (!create || pc->socklen > NGX_SOCKADDRLEN) {
+        return NULL;
+    }
+
+    pool = ngx_pcalloc(ngx_cycle->pool,
+                       sizeof(ngx_http_ajp_upstream_pool_t)
+                       + conf->max_idle
+                         * sizeof(ngx_http_ajp_upstream_cache_t));
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    pool->conf = conf;
+    pool->socklen = pc->socklen;
+    ngx_memcpy(pool->sockaddr, pc->sockaddr, pc->socklen);
+
+    ngx_queue_init(&pool->idle);
+    ngx_queue_init(&pool->free);
+
+    cache = (ngx_http_ajp_upstream_cache_t *) (pool + 1);
+
+    for (i = 0; i < conf->max_idle; i++) {
+        cache[i].pool = pool;
+        ngx_queue_insert_head(&pool->free, &cache[i].queue);
+    }
+
+    ngx_queue_insert_tail(&conf->pools, &pool->queue);
+
+    return pool;
+}
+
+
+/*
+ * The write timer of an idle connection sends CPING once in ping_interval,
+ * and then bounds the wait for CPONG with ping_timeout.
+ */
+static void
+ngx_http_ajp_upstream_ping_handler(ngx_event_t *ev)
+{
+    ssize_t                             n;
+    ngx_connection_t                   *c;
+    ngx_http_ajp_upstream_cache_t      *item;
+    ngx_http_ajp_upstream_srv_conf_t   *conf;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "ajp upstream ping handler");
+
+    if (!ev->timedout) {
+        return;
+    }
+
+    ev->timedout = 0;
+
+    c = ev->data;
+    item = c->data;
+    conf = item->pool->conf;
+
+    if (item->ping) {
+        ngx_log_error(NGX_LOG_WARN, c->log, 0,
+                      "ajp upstream CPONG timed out, connection closed");
+        ngx_http_ajp_upstream_drop(item);
+        return;
+    }
+
+    n = c->send(c, conf->cping.data, conf->cping.len);
+
+    if (n != (ssize_t) conf->cping.len) {
+        ngx_http_ajp_upstream_drop(item);
+        return;
+    }
+
+    item->ping = 1;
+
+    ngx_add_timer(ev, conf->ping_timeout);
+}
+
+
+static void
+ngx_http_ajp_upstream_close_handler(ngx_event_t *ev)
+{
+    int                             n;
+    u_char                          buf[sizeof(ngx_http_ajp_cpong)];
+    ngx_connection_t               *c;
+    ngx_http_ajp_upstream_pool_t   *pool;
+    ngx_http_ajp_upstream_cache_t  *item;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "ajp upstream close handler");
+
+    c = ev->data;
+    item = c->data;
+    pool = item->pool;
+
+    if (c->close) {
+        goto close;
+    }
+
+    if (ev->timedout) {
+
+        if (pool->nidle > pool->conf->min_idle) {
+            goto close;
+        }
+
+        /* kept until the container closes it */
+
+        ev->timedout = 0;
+        ngx_add_timer(ev, pool->conf->timeout);
+
+        return;
+    }
+
+    for ( ;; ) {
+
+        /*
+         * an idle connection is unusable once it has data or is closed,
+         * except for the CPONG it waits for
+         */
+
+        n = recv(c->fd, (char *) buf, sizeof(buf), MSG_PEEK);
+
+        if (n == -1 && ngx_socket_errno == NGX_EAGAIN) {
+            ev->ready = 0;
+
+            if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+                goto close;
+            }
+
+            return;
+        }
+
+        if (!item->ping
+            || n <= 0
+            || ngx_memcmp(buf, ngx_http_ajp_cpong, n) != 0)
+        {
+            goto close;
+        }
+
+        if (n < (int) sizeof(buf)) {
+
+            /* the rest of CPONG is yet to come */
+
+            ev->ready = 0;
+
+            if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+                goto close;
+            }
+
+            return;
+        }
+
+        if (recv(c->fd, (char *) buf, sizeof(buf), 0) != (int) sizeof(buf)) {
+            goto close;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                       "ajp upstream CPONG received, connection %p", c);
+
+        item->ping = 0;
+
+        ngx_add_timer(c->write, pool->conf->ping_interval);
+    }
+
+close:
+
+    ngx_http_ajp_upstream_drop(item);
+}
+
+
+static void
+ngx_http_ajp_upstream_drop(ngx_http_ajp_upstream_cache_t *item)
+{
+    ngx_http_ajp_upstream_pool_t  *pool;
+
+    pool = item->pool;
+
+    ngx_http_ajp_upstream_close(item->connection);
+
+    ngx_queue_remove(&item->queue);
+    ngx_queue_insert_head(&pool->free, &item->queue);
+    pool->nidle--;
+}
+
+
+static void
+ngx_http_ajp_upstream_close(ngx_connection_t *c)
+{
+    ngx_destroy_pool(c->pool);
+    ngx_close_connection(c);
+}
+
+
+#if (nginx_version >= 1009000)
+
+static ngx_int_t
+ngx_http_ajp_upstream_init_check(ngx_conf_t *cf,
+    ngx_http_upstream_srv_conf_t *us, ngx_http_ajp_check_t *check)
+{
+    size_t                         size;
+    ngx_str_t                      name;
+    ngx_uint_t                     i;
+    ngx_shm_zone_t                *shm_zone;
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_upstream_rr_peers_t  *peers;
+
+    /* the balancers of nginx all keep the round robin peers */
+
+    for (peers = us->peer.data; peers; peers = peers->next) {
+        check->number += peers->number;
+    }
+
+    if (check->number == 0) {
+        return NGX_OK;
+    }
+
+    check->servers = ngx_palloc(cf->pool,
+                             check->number
+                             * sizeof(ngx_http_ajp_check_server_t));
+    if (check->servers == NULL) {
+        return NGX_ERROR;
+    }
+
+    i = 0;
+
+    for (peers = us->peer.data; peers; peers = peers->next) {
+        for (peer = peers->peer; peer; peer = peer->next, i++) {
+            check->servers[i].sockaddr = peer->sockaddr;
+            check->servers[i].socklen = ngx_min(peer->socklen,
+                                                NGX_SOCKADDRLEN);
+            check->servers[i].down = peer->down;
+        }
+    }
+
+    name.len = sizeof("ajp_health_check:") - 1 + us->host.len;
+
+    name.data = ngx_pnalloc(cf->pool, name.len);
+    if (name.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(name.data, "ajp_health_check:%V", &us->host);
+
+    size = 8 * ngx_pagesize
+           + ngx_align(check->number * sizeof(ngx_http_ajp_check_peer_t),
+                       ngx_pagesize);
+
+    shm_zone = ngx_shared_memory_add(cf, &name, size, &ngx_http_ajp_module);
+    if (shm_zone == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate zone \"%V\"", &name);
+        return NGX_ERROR;
+    }
+
+    shm_zone->init = ngx_http_ajp_upstream_init_check_zone;
+    shm_zone->data = check;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_ajp_upstream_init_check_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_ajp_check_t  *ocheck = data;
+
+    ngx_uint_t                    i, n;
+    ngx_slab_pool_t              *shpool;
+    ngx_http_ajp_check_t         *check;
+    ngx_http_ajp_check_peer_t    *sh, *osh;
+    ngx_http_ajp_check_server_t  *server;
+
+    check = shm_zone->data;
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (ocheck) {
+
+        /* the same servers in the same order keep their state in place */
+
+        if (ocheck->number == check->number) {
+
+            for (i = 0; i < check->number; i++) {
+                if (ngx_cmp_sockaddr(check->servers[i].sockaddr,
+                                     check->servers[i].socklen,
+                                     (struct sockaddr *) ocheck->sh[i].sockaddr,
+                                     ocheck->sh[i].socklen, 1)
+                    != NGX_OK)
+                {
+                    break;
+                }
+            }
+
+            if (i == check->number) {
+                check->sh = ocheck->sh;
+                return NGX_OK;
+            }
+        }
+
+    } else if (shm_zone->shm.exists) {
+        check->sh = shpool->data;
+        return NGX_OK;
+    }
+
+    check->sh = ngx_slab_alloc(shpool,
+                               check->number
+                               * sizeof(ngx_http_ajp_check_peer_t));
+    if (check->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(check->sh, check->number * sizeof(ngx_http_ajp_check_peer_t));
+
+    for (i = 0; i < check->number; i++) {
+        server = &check->servers[i];
+        sh = &check->sh[i];
+
+        ngx_memcpy(sh->sockaddr, server->sockaddr, server->socklen);
+        sh->socklen = server->socklen;
+
+        if (ocheck == NULL) {
+            continue;
+        }
+
+        /* the servers kept in the upstream take their state with them */
+
+        for (n = 0; n < ocheck->number; n++) {
+            osh = &ocheck->sh[n];
+
+            if (ngx_cmp_sockaddr(server->sockaddr, server->socklen,
+                                 (struct sockaddr *) osh->sockaddr,
+                                 osh->socklen, 1)
+                == NGX_OK)
+            {
+                sh->checked = osh->checked;
+                sh->rtt = osh->rtt;
+                sh->fails = osh->fails;
+                sh->passes = osh->passes;
+                sh->down = osh->down;
+                break;
+            }
+        }
+    }
+
+    /*
+     * The old array is not freed: the old workers still check their peers
+     * into it until they exit. It is only replaced when the servers change.
+     */
+
+    shpool->data = check->sh;
+
+    return NGX_OK;
+}
+
+#endif
+
+
+/* This will be called in the ajp_module's init_process function. */
+ngx_int_t
+ngx_http_ajp_upstream_init_process(ngx_cycle_t *cycle)
+{
+#if (nginx_version >= 1009000)
+
+    ngx_uint_t                         i, j;
+    ngx_http_ajp_check_t              *check;
+    ngx_http_upstream_srv_conf_t     **uscfp;
+    ngx_http_upstream_main_conf_t     *umcf;
+    ngx_http_ajp_upstream_srv_conf_t  *ascf;
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return NGX_OK;
+    }
+
+    umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+    if (umcf == NULL) {
+        return NGX_OK;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        ascf = ngx_http_conf_upstream_srv_conf(uscfp[i], ngx_http_ajp_module);
+        check = ascf->check;
+
+        if (check == NULL || check->number == 0) {
+            continue;
+        }
+
+        check->ctx = ngx_pcalloc(cycle->pool,
+                                 check->number
+                                 * sizeof(ngx_http_ajp_check_ctx_t));
+        if (check->ctx == NULL) {
+            return NGX_ERROR;
+        }
+
+        for (j = 0; j < check->number; j++) {
+            check->ctx[j].check = check;
+            check->ctx[j].index = j;
+        }
+
+        check->timer.handler = ngx_http_ajp_upstream_check_timer;
+        check->timer.data = check;
+        check->timer.log = cycle->log;
+#if (nginx_version >= 1007011)
+        check->timer.cancelable = 1;
+#endif
+
+        /* the workers start apart, whichever is due checks a peer */
+
+        ngx_add_timer(&check->timer, ngx_random() % check->interval + 1);
+    }
+
+#endif
+
+    return NGX_OK;
+}
+
+
+#if (nginx_version >= 1009000)
+
+/*
+ * Each worker applies the shared state to its peers, and checks the
+ * peers no other worker has checked within the interval.
+ */
+static void
+ngx_http_ajp_upstream_check_timer(ngx_event_t *ev)
+{
+    ngx_msec_t                     checked;
+    ngx_uint_t                     i;
+    ngx_http_ajp_check_t          *check;
+    ngx_http_ajp_check_ctx_t      *ctx;
+    ngx_http_ajp_check_peer_t     *sh;
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_upstream_rr_peers_t  *peers;
+
+    check = ev->data;
+
+    if (ngx_terminate || ngx_exiting || ngx_quit) {
+        return;
+    }
+
+    i = 0;
+
+    /* the peers are in the upstream zone, if any, by now */
+
+    for (peers = check->upstream->peer.data; peers; peers = peers->next) {
+
+        ngx_http_upstream_rr_peers_wlock(peers);
+
+        for (peer = peers->peer;
+             peer && i < check->number;
+             peer = peer->next, i++)
+        {
+            sh = &check->sh[i];
+            ctx = &check->ctx[i];
+
+            peer->down = check->servers[i].down || sh->down;
+
+            checked = sh->checked;
+
+            if (ctx->busy
+                || check->servers[i].down
+                || peer->socklen > NGX_SOCKADDRLEN
+                || ngx_current_msec - checked < check->interval
+                || !ngx_atomic_cmp_set(&sh->checked, checked,
+                                       ngx_current_msec))
+            {
+                continue;
+            }
+
+            ngx_memcpy(ctx->sockaddr, peer->sockaddr, peer->socklen);
+            ctx->socklen = peer->socklen;
+            ctx->pc.name = &peer->name;
+            ctx->pending = 1;
+        }
+
+        ngx_http_upstream_rr_peers_unlock(peers);
+    }
+
+    for (i = 0; i < check->number; i++) {
+        if (check->ctx[i].pending) {
+            check->ctx[i].pending = 0;
+            ngx_http_ajp_upstream_check_peer(&check->ctx[i]);
+        }
+    }
+
+    ngx_add_timer(ev, check->interval);
+}
+
+
+static void
+ngx_http_ajp_upstream_check_peer(ngx_http_ajp_check_ctx_t *ctx)
+{
+    ngx_int_t          rc;
+    ngx_str_t         *name;
+    ngx_connection_t  *c;
+
+    name = ctx->pc.name;
+
+    ngx_memzero(&ctx->pc, sizeof(ngx_peer_connection_t));
+
+    ctx->pc.sockaddr = (struct sockaddr *) ctx->sockaddr;
+    ctx->pc.socklen = ctx->socklen;
+    ctx->pc.name = name;
+    ctx->pc.get = ngx_event_get_peer;
+    ctx->pc.log = ngx_cycle->log;
+    ctx->pc.log_error = NGX_ERROR_ERR;
+
+    ctx->busy = 1;
+    ctx->sent = 0;
+    ctx->received = 0;
+    ctx->start = ngx_current_msec;
+
+    rc = ngx_event_connect_peer(&ctx->pc);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        ngx_http_ajp_upstream_check_done(ctx, 0);
+        return;
+    }
+
+    c = ctx->pc.connection;
+
+    c->data = ctx;
+    c->read->handler = ngx_http_ajp_upstream_check_handler;
+    c->write->handler = ngx_http_ajp_upstream_check_handler;
+
+    ngx_add_timer(c->write, ctx->check->timeout);
+
+    if (rc == NGX_OK) {
+        ngx_http_ajp_upstream_check_handler(c->write);
+    }
+}
+
+
+static void
+ngx_http_ajp_upstream_check_handler(ngx_event_t *ev)
+{
+    ssize_t                    n;
+    ngx_str_t                 *cping;
+    ngx_connection_t          *c;
+    ngx_http_ajp_check_ctx_t  *ctx;
+
+    c = ev->data;
+    ctx = c->data;
+    cping = &ctx->check->conf->cping;
+
+    if (ev->timedout) {
+        ngx_log_error(NGX_LOG_WARN, c->log, 0,
+                      "ajp health check of %V timed out", ctx->pc.name);
+        ngx_http_ajp_upstream_check_done(ctx, 0);
+        return;
+    }
+
+    if (ctx->sent < cping->len) {
+
+        n = c->send(c, cping->data + ctx->sent, cping->len - ctx->sent);
+
+        if (n == NGX_ERROR) {
+            ngx_http_ajp_upstream_check_done(ctx, 0);
+            return;
+        }
+
+        if (n > 0) {
+            ctx->sent += n;
+        }
+
+        if (ctx->sent < cping->len) {
+            if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+                ngx_http_ajp_upstream_check_done(ctx, 0);
+            }
+
+            return;
+        }
+    }
+
+    for ( ;; ) {
+
+        n = c->recv(c, ctx->buf + ctx->received,
+                    sizeof(ngx_http_ajp_cpong) - ctx->received);
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+                ngx_http_ajp_upstream_check_done(ctx, 0);
+            }
+
+            return;
+        }
+
+        if (n == NGX_ERROR || n == 0
+            || ngx_memcmp(ctx->buf + ctx->received,
+                          ngx_http_ajp_cpong + ctx->received, n)
+               != 0)
+        {
+            ngx_log_error(NGX_LOG_WARN, c->log, 0,
+                          "ajp health check of %V failed, no CPONG",
+                          ctx->pc.name);
+            ngx_http_ajp_upstream_check_done(ctx, 0);
+            return;
+        }
+
+        ctx->received += n;
+
+        if (ctx->received == sizeof(ngx_http_ajp_cpong)) {
+            ngx_http_ajp_upstream_check_done(ctx, 1);
+            return;
+        }
+    }
+}
+
+
+static void
+ngx_http_ajp_upstream_check_done(ngx_http_ajp_check_ctx_t *ctx,
+    ngx_uint_t up)
+{
+    ngx_http_ajp_check_t       *check;
+    ngx_http_ajp_check_peer_t  *sh;
+
+    check = ctx->check;
+    sh = &check->sh[ctx->index];
+
+    if (ctx->pc.connection) {
+        ngx_close_connection(ctx->pc.connection);
+        ctx->pc.connection = NULL;
+    }
+
+    ctx->busy = 0;
+
+    /* only the worker which claimed the check updates the peer */
+
+    if (up) {
+        sh->rtt = ngx_current_msec - ctx->start;
+        sh->fails = 0;
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "ajp health check of %V: CPONG in %Mms",
+                       ctx->pc.name, sh->rtt);
+
+        if (sh->down && ++sh->passes >= check->passes) {
+            sh->down = 0;
+            sh->passes = 0;
+
+            ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                          "ajp health check: %V is up", ctx->pc.name);
+        }
+
+        return;
+    }
+
+    sh->passes = 0;
+
+    if (!sh->down && ++sh->fails >= check->fails) {
+        sh->down = 1;
+        sh->fails = 0;
+
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                      "ajp health check: %V is down", ctx->pc.name);
+    }
+}
+
+#endif
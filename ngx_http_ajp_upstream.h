@@ -0,0 +1,52 @@
+
+#ifndef _NGX_AJP_UPSTREAM_H_INCLUDED_
+#define _NGX_AJP_UPSTREAM_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+typedef struct ngx_http_ajp_check_s  ngx_http_ajp_check_t;
+
+
+typedef struct {
+    /* the idle connections kept per peer, 0 if there is no pool */
+    ngx_uint_t                          max_idle;
+    /* the idle connections per peer the timeout does not close */
+    ngx_uint_t                          min_idle;
+    ngx_msec_t                          timeout;
+
+    /* the idle connections are checked with CPING once in ping_interval */
+    ngx_flag_t                          ping;
+    ngx_msec_t                          ping_timeout;
+    ngx_msec_t                          ping_interval;
+    ngx_str_t                           cping;
+
+    /* the active health checks, NULL if there are none */
+    ngx_http_ajp_check_t               *check;
+
+    /* the pools of the peers, created in each worker on their first use */
+    ngx_queue_t                         pools;
+
+    ngx_http_upstream_init_pt           original_init_upstream;
+    ngx_http_upstream_init_peer_pt      original_init_peer;
+} ngx_http_ajp_upstream_srv_conf_t;
+
+
+void *ngx_http_ajp_upstream_create_srv_conf(ngx_conf_t *cf);
+
+char *ngx_http_ajp_keepalive(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+char *ngx_http_ajp_ping(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+#if (nginx_version >= 1009000)
+char *ngx_http_ajp_health_check(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+#endif
+
+ngx_int_t ngx_http_ajp_upstream_init_process(ngx_cycle_t *cycle);
+
+
+#endif /* _NGX_AJP_UPSTREAM_H_INCLUDED_ */
@@ -25,6 +25,7 @@ use Test::Nginx::Util qw(
     $ServRoot
     $ConfFile
     $ServerPort
+    $ErrLogFile
     $RunTestHelper
     $NoNginxManager
     $RepeatEach
@@ -169,6 +170,10 @@ sub run_test_helper ($$) {
 
     #warn "res returned!!!";
 
+    if (!$dry_run && defined $block->wait) {
+        sleep($block->wait);
+    }
+
     if ($dry_run) {
         SKIP: {
             Test::More::skip("$name - tests skipped due to the lack of directive $dry_run", 1);
@@ -259,6 +264,54 @@ sub run_test_helper ($$) {
             like($content, qr/$expected_pat/s, "$name - response_body_like - response is expected ($summary)");
         }
     }
+
+    check_error_log($block, $dry_run);
+}
+
+sub error_log_patterns ($) {
+    my $section = shift;
+
+    return () unless defined $section;
+
+    return grep { $_ ne '' } map { trim($_) } split /\n+/, $section;
+}
+
+sub check_error_log ($$) {
+    my ($block, $dry_run) = @_;
+    my $name = $block->name;
+
+    my @error_log = error_log_patterns($block->error_log);
+    my @no_error_log = error_log_patterns($block->no_error_log);
+
+    return unless @error_log || @no_error_log;
+
+    my $log = '';
+    if (!$dry_run && open my $in, '<', $ErrLogFile) {
+        $log = do { local $/; <$in> };
+        close $in;
+    }
+
+    for my $pat (@error_log) {
+        if ($dry_run) {
+            SKIP: {
+                Test::More::skip("$name - tests skipped due to the lack of directive $dry_run", 1);
+            }
+        } else {
+            ok(index($log, $pat) >= 0,
+               "$name - pattern \"$pat\" matches a line in error.log");
+        }
+    }
+
+    for my $pat (@no_error_log) {
+        if ($dry_run) {
+            SKIP: {
+                Test::More::skip("$name - tests skipped due to the lack of directive $dry_run", 1);
+            }
+        } else {
+            ok(index($log, $pat) < 0,
+               "$name - pattern \"$pat\" should not match any line in error.log");
+        }
+    }
 }
 
 1;
@@ -434,6 +487,18 @@ The following sections are supported:
 
 =item start_chunk_delay
 
+=item wait
+
+Seconds to sleep after the response, before the error log is checked.
+
+=item error_log
+
+Each line is a string which must be found in the error log.
+
+=item no_error_log
+
+Each line is a string which must not be found in the error log.
+
 =back
 
 =head1 Samples
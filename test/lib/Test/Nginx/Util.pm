@@ -129,6 +129,7 @@ our @EXPORT_OK = qw(
     run_tests
     $ServerPortForClient
     $ServerPort
+    $ErrLogFile
     $NginxVersion
     $PidFile
     $ServRoot
@@ -491,6 +492,10 @@ sub run_test ($) {
 
     $config = expand_env_in_config($config);
 
+    # the nginx.conf also differs by the http_config and the main_config
+    my $full_config = join "\n", grep { defined } $config,
+                           $block->http_config, $block->main_config;
+
     my $dry_run = 0;
     my $should_restart = 1;
     my $should_reconfig = 1;
@@ -518,7 +523,7 @@ sub run_test ($) {
     } else {
         # One config and manager. Restart only if forced to or if config
         # changed.
-        if ((!defined $PrevConfig) || ($config ne $PrevConfig)) {
+        if ((!defined $PrevConfig) || ($full_config ne $PrevConfig)) {
             $should_reconfig = 1;
         } else {
             $should_reconfig = 0;
@@ -641,7 +646,7 @@ sub run_test ($) {
 
     if (!$NoNginxManager && !$should_skip && $should_restart) {
         if ($should_reconfig) {
-            $PrevConfig = $config;
+            $PrevConfig = $full_config;
         }
         my $nginx_is_running = 1;
         if (-f $PidFile) {
@@ -3,7 +3,7 @@
 use lib 'lib';
 use Test::Nginx::LWP;
 
-plan tests => repeat_each() * 2 * blocks();
+plan tests => repeat_each() * (2 * blocks() + 5);
 $ENV{TEST_NGINX_TOMCAT_AJP_PORT} ||= 8009;
 no_root_location();
 
@@ -26,3 +26,102 @@ __DATA__
 --- request
     GET /index.html
 --- response_body_like: ^(.*)$
+
+=== TEST 2: the GET of AJP with the zero copy header packet
+--- http_config
+    upstream tomcats{
+        server 127.0.0.1:$TEST_NGINX_TOMCAT_AJP_PORT;
+        keepalive 10;
+    }
+--- config
+    location / {
+        ajp_header_packet_zero_copy on;
+        ajp_pass tomcats;
+    }
+--- request_headers
+Cookie: JSESSIONID=0123456789abcdef0123456789abcdef; a=0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef
+--- request
+    GET /echo.jsp?header=Cookie
+--- error_code: 200
+--- response_body_like: ^header Cookie: JSESSIONID=0123456789abcdef0123456789abcdef; a=0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef\s*$
+--- no_error_log
+[error]
+
+=== TEST 3: the GET of AJP with the selected attributes
+--- http_config
+    upstream tomcats{
+        server 127.0.0.1:$TEST_NGINX_TOMCAT_AJP_PORT;
+        keepalive 10;
+    }
+--- config
+    location / {
+        ajp_forward_attributes jvm_route remote_port;
+        ajp_pass tomcats;
+    }
+--- request
+    GET /echo.jsp?remote_port=1
+--- error_code: 200
+--- response_body_like: ^remote port: [1-9][0-9]*\s*$
+--- no_error_log
+[error]
+
+=== TEST 4: the GET of AJP with the request attributes
+--- http_config
+    upstream tomcats{
+        server 127.0.0.1:$TEST_NGINX_TOMCAT_AJP_PORT;
+        keepalive 10;
+    }
+--- config
+    location / {
+        ajp_param tenant example;
+        ajp_param host $host;
+        ajp_param route $cookie_route if_not_empty;
+        ajp_pass tomcats;
+    }
+--- request
+    GET /echo.jsp?attribute=tenant&attribute=host&attribute=route
+--- error_code: 200
+--- response_body_like: ^attribute tenant: example\r?\nattribute host: localhost\r?\nattribute route: null\s*$
+--- no_error_log
+[error]
+
+=== TEST 5: the GET of AJP with the request header rules
+--- http_config
+    upstream tomcats{
+        server 127.0.0.1:$TEST_NGINX_TOMCAT_AJP_PORT;
+        keepalive 10;
+    }
+--- config
+    location / {
+        ajp_hide_header_in X-Tracking;
+        ajp_set_header X-Tenant $host;
+        ajp_set_header Accept-Encoding "";
+        ajp_pass tomcats;
+    }
+--- request_headers
+X-Tracking: 0123456789abcdef
+Accept-Encoding: gzip
+--- request
+    GET /echo.jsp?header=X-Tracking&header=X-Tenant&header=Accept-Encoding
+--- error_code: 200
+--- response_body_like: ^header X-Tracking: null\r?\nheader X-Tenant: localhost\r?\nheader Accept-Encoding: null\s*$
+--- no_error_log
+[error]
+
+=== TEST 6: the GET of AJP with the body chunks coalesced
+--- http_config
+    upstream tomcats{
+        server 127.0.0.1:$TEST_NGINX_TOMCAT_AJP_PORT;
+        keepalive 10;
+    }
+--- config
+    location / {
+        ajp_coalesce_body_chunks on;
+        ajp_pass tomcats;
+    }
+--- request
+    GET /index.html
+--- error_code: 200
+--- response_body_like: <h1>Welcome to tomcat!</h1>
+--- no_error_log
+[error]
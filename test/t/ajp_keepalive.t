@@ -3,7 +3,7 @@
 use lib 'lib';
 use Test::Nginx::LWP;
 
-plan tests => repeat_each() * 2 * blocks();
+plan tests => repeat_each() * (2 * blocks() + 7);
 $ENV{TEST_NGINX_TOMCAT_AJP_PORT} ||= 8009;
 no_root_location();
 
@@ -68,3 +68,86 @@ __DATA__
 --- request
     GET /index.html
 --- response_body_like: ^(.*)$
+
+=== TEST 5: the GET of AJP with keepalive, without buffering
+--- http_config
+    upstream tomcats{
+        server 127.0.0.1:$TEST_NGINX_TOMCAT_AJP_PORT;
+        keepalive 10;
+    }
+--- config
+    location / {
+        ajp_keep_conn on;
+        ajp_buffering off;
+        ajp_pass tomcats;
+    }
+--- request
+    GET /index.html
+--- error_code: 200
+--- response_body_like: <h1>Welcome to tomcat!</h1>
+--- no_error_log
+[error]
+
+=== TEST 6: the GET of AJP with the AJP connection pool
+--- http_config
+    upstream tomcats{
+        server 127.0.0.1:$TEST_NGINX_TOMCAT_AJP_PORT;
+        ajp_keepalive 10 min_idle=2 timeout=30s;
+    }
+--- config
+    location / {
+        ajp_keep_conn on;
+        ajp_pass tomcats;
+    }
+--- request
+    GET /index.html
+--- error_code: 200
+--- response_body_like: <h1>Welcome to tomcat!</h1>
+--- error_log
+free ajp upstream connection
+--- no_error_log
+[error]
+
+=== TEST 7: the GET of AJP with the AJP connection pool checked by CPING
+--- http_config
+    upstream tomcats{
+        server 127.0.0.1:$TEST_NGINX_TOMCAT_AJP_PORT;
+        ajp_keepalive 10;
+        ajp_ping on;
+        ajp_ping_interval 1s;
+        ajp_ping_timeout 1s;
+    }
+--- config
+    location / {
+        ajp_keep_conn on;
+        ajp_pass tomcats;
+    }
+--- request
+    GET /index.html
+--- error_code: 200
+--- response_body_like: <h1>Welcome to tomcat!</h1>
+--- wait: 2
+--- error_log
+ajp upstream CPONG received
+--- no_error_log
+[error]
+
+=== TEST 8: the GET of AJP with the servers checked by CPING
+--- http_config
+    upstream tomcats{
+        server 127.0.0.1:$TEST_NGINX_TOMCAT_AJP_PORT;
+        ajp_health_check interval=1s timeout=1s fails=2 passes=2;
+    }
+--- config
+    location / {
+        ajp_pass tomcats;
+    }
+--- request
+    GET /index.html
+--- error_code: 200
+--- response_body_like: <h1>Welcome to tomcat!</h1>
+--- wait: 2
+--- error_log
+CPONG in
+--- no_error_log
+[error]
@@ -0,0 +1,14 @@
+<%@ page language="java" contentType="text/plain" %><%
+    /* print the length of the request body and the bytes read from it */
+    java.io.InputStream in = request.getInputStream();
+    byte[] buf = new byte[8192];
+    long read = 0;
+    int n;
+
+    while ((n = in.read(buf)) != -1) {
+        read += n;
+    }
+
+    out.println("length: " + request.getContentLength());
+    out.println("read: " + read);
+%>
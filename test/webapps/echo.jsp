@@ -0,0 +1,24 @@
+<%@ page language="java" contentType="text/plain" %><%
+    /* print the request headers and attributes asked in the query string */
+    String[] names;
+
+    names = request.getParameterValues("header");
+    if (names != null) {
+        for (int i = 0; i < names.length; i++) {
+            out.println("header " + names[i] + ": "
+                        + request.getHeader(names[i]));
+        }
+    }
+
+    names = request.getParameterValues("attribute");
+    if (names != null) {
+        for (int i = 0; i < names.length; i++) {
+            out.println("attribute " + names[i] + ": "
+                        + request.getAttribute(names[i]));
+        }
+    }
+
+    if (request.getParameter("remote_port") != null) {
+        out.println("remote port: " + request.getRemotePort());
+    }
+%>